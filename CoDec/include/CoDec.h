@@ -15,8 +15,44 @@ typedef unsigned char uchar;
 #define MAGIC_GRAY 0xD1FF
 /** @brief Magic number for RGB DIF files */
 #define MAGIC_RGB  0xD3FF
+/** @brief Magic number for grayscale DIF files with an extended header */
+#define MAGIC_GRAY_EXT 0xD1FE
+/** @brief Magic number for RGB DIF files with an extended header */
+#define MAGIC_RGB_EXT  0xD3FE
 /** @brief Number of quantization levels */
 #define NUM_LEVELS 4     
+/** @brief Maximum number of interleaved bitstreams */
+#define MAX_STREAMS 8
+/** @brief Maximum number of downsampled pyramid levels (down to 1/8 scale) */
+#define MAX_LEVELS 3
+
+/** @brief Extended header flag: residuals are spread round-robin over several bitstreams */
+#define DIF_FLAG_STREAMS 0x01
+/** @brief Extended header flag: downsampled levels are stored before the full image */
+#define DIF_FLAG_PYRAMID 0x02
+/** @brief Extended header flag: runs of zero residuals are coded as single tokens */
+#define DIF_FLAG_RUNS    0x04
+/** @brief Extended header flag: bands of rows are coded independently and hashed */
+#define DIF_FLAG_RESTART 0x08
+/** @brief Extended header flag: RGB samples are coded as YCoCg-R modulo 128 */
+#define DIF_FLAG_COLOR   0x10
+
+/** @brief Daemon request: encode a PNM payload to DIF */
+#define DAEMON_OP_ENCODE 1
+/** @brief Daemon request: decode a DIF payload to PNM */
+#define DAEMON_OP_DECODE 2
+/** @brief Daemon request: report health and latency counters as text */
+#define DAEMON_OP_STATS  3
+/** @brief Daemon request flag: payload is read from a descriptor passed with SCM_RIGHTS */
+#define DAEMON_FLAG_FD   0x01
+/** @brief Daemon request flag: encode with runs of zero residuals (DIF_FLAG_RUNS) */
+#define DAEMON_FLAG_RUNS 0x02
+/** @brief Daemon request flag: encode with the YCoCg-R color transform (DIF_FLAG_COLOR) */
+#define DAEMON_FLAG_COLOR 0x04
+/** @brief Largest payload accepted by the daemon, in bytes */
+#define DAEMON_MAX_PAYLOAD (256 * 1024 * 1024)
+/** @brief Default size cap of the encoding cache, in bytes */
+#define CACHE_DEFAULT_MAX (1024L * 1024 * 1024)
 
 /**
  * @brief Structure representing a picture/image
@@ -55,38 +91,146 @@ typedef struct {
     int bounds[NUM_LEVELS];
 } Quantizer;
 
+/**
+ * @brief Encoder settings selecting the optional DIF coding modes
+ * @var Params::streams Number of interleaved bitstreams (1, 4 or 8)
+ * @var Params::pyramid Number of downsampled levels to store (0 to MAX_LEVELS)
+ * @var Params::runs Code runs of zero residuals as single tokens
+ * @var Params::band_rows Rows per independently coded band (0 for none, 1 to 65535)
+ * @var Params::color Decorrelate RGB channels with YCoCg-R (ignored for grayscale)
+ */
+typedef struct {
+    int streams;
+    int pyramid;
+    int runs;
+    int band_rows;
+    int color;
+} Params;
+
 /**
  * @brief Command-line options structure
  * @var Options::verbose Enable verbose output
  * @var Options::timing Enable timing measurements
  * @var Options::start_time Starting time for timing
+ * @var Options::log Stream receiving verbose and timing messages (stdout if NULL)
  */
 typedef struct {
     int verbose;
     int timing;
     clock_t start_time;
+    FILE *log;
 } Options;
 
+/**
+ * @brief Output file opened by open_output
+ * @var Output::fp Stream to write to
+ * @var Output::path Path the temporary file replaces, or the created file (NULL otherwise)
+ * @var Output::tmp Temporary file beside path, or NULL when writing in place
+ * @var Output::created The file did not exist and is removed on failure
+ */
+typedef struct {
+    FILE *fp;
+    char *path;
+    char *tmp;
+    int created;
+} Output;
+
 /* ========================================================================
  * PROTOTYPES DES FONCTIONS (Exportées pour le main)
  * ======================================================================== */
 
 /**
  * @brief Converts a PNM image to DIF format
- * @param input Path to input PNM file
- * @param output Path to output DIF file
+ * @param input Path to input PNM file ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
  * @return 0 on success, 1 on failure
  */
 int pnmtodif(const char *input, const char *output);
 
+/**
+ * @brief Converts a PNM image to DIF format using the given coding modes
+ * @param input Path to input PNM file ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_params(const char *input, const char *output, const Params *params);
+
+/**
+ * @brief Encodes a PNM image read from a stream into a DIF stream
+ * @param in Input stream positioned at the PNM header
+ * @param out Output stream receiving the DIF file
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_file(FILE *in, FILE *out, const Params *params);
+
+/**
+ * @brief Updates a banded DIF file for a new version of its image
+ *
+ * Bands whose pixels did not change are copied from the previous file
+ * without being decoded or recoded; only the changed bands are coded.
+ * A previous file without bands, or of another size, is replaced by a
+ * full encoding with 16 rows per band. The output is
+ * written next to its final path and renamed over it, so it may be the
+ * previous file itself.
+ *
+ * @param previous Path to the previous DIF file
+ * @param input Path to the new PNM image ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param recoded Receives the number of bands coded (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int difupdate(const char *previous, const char *input, const char *output, int *recoded);
+
+/**
+ * @brief Updates a banded DIF stream for a new version of its image
+ * @param prev Previous DIF stream positioned at its header
+ * @param in Input stream positioned at the PNM header
+ * @param out Output stream receiving the DIF file
+ * @param recoded Receives the number of bands coded (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int difupdate_file(FILE *prev, FILE *in, FILE *out, int *recoded);
+
 /**
  * @brief Converts a DIF image to PNM format
- * @param input Path to input DIF file
- * @param output Path to output PNM file
+ * @param input Path to input DIF file ("-" for stdin)
+ * @param output Path to output PNM file ("-" for stdout)
  * @return 0 on success, 1 on failure
  */
 int diftopnm(const char *input, const char *output);
 
+/**
+ * @brief Decodes a DIF stream into a PNM stream
+ * @param in Input stream positioned at the DIF header
+ * @param out Output stream receiving the PNM image
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_file(FILE *in, FILE *out);
+
+/**
+ * @brief Converts a DIF image to a reduced-size PNM image
+ *
+ * Pyramid files are decoded from their stored levels, reading only the
+ * part of the file needed; other files are decoded fully and downsampled.
+ *
+ * @param input Path to input DIF file ("-" for stdin)
+ * @param output Path to output PNM file ("-" for stdout)
+ * @param scale Reduction factor (1, 2, 4 or 8)
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_scaled(const char *input, const char *output, int scale);
+
+/**
+ * @brief Decodes a DIF stream into a reduced-size PNM stream
+ * @param in Input stream positioned at the DIF header
+ * @param out Output stream receiving the PNM image
+ * @param scale Reduction factor (1, 2, 4 or 8)
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_file_scaled(FILE *in, FILE *out, int scale);
+
 /**
  * @brief Checks if a tool is available in the system
  * @param tool Name of the tool to check
@@ -137,6 +281,45 @@ long file_size(const char *path);
  */
 long get_raw_size(const char *pnm);
 
+/**
+ * @brief Hashes the dimensions and pixels of a PNM image
+ * @param path Path to the PNM file
+ * @param hash Receives the 64-bit FNV-1a hash (header comments are ignored)
+ * @return 1 on success, 0 on failure
+ */
+int pnm_hash(const char *path, unsigned long long *hash);
+
+/**
+ * @brief Opens an output path for writing
+ *
+ * An existing regular file (symbolic links followed) is written to a
+ * temporary file beside it that keeps its mode and replaces it only once
+ * complete, so it may also be the input. New files, FIFOs and devices are
+ * written in place.
+ *
+ * @param o Receives the open output
+ * @param path Path to the output file ("-" for stdout)
+ * @param input Path to the input file ("-" for stdin), or NULL
+ * @return 1 on success, 0 on failure
+ */
+int open_output(Output *o, const char *path, const char *input);
+
+/**
+ * @brief Closes an output opened with open_output, publishing it on success
+ * @param o Output to close
+ * @param result Result of the conversion (0 on success)
+ * @return 0 on success, 1 on failure
+ */
+int close_output(Output *o, int result);
+
+/**
+ * @brief Hashes the whole content of a file
+ * @param path Path to the file
+ * @param hash Receives the 64-bit FNV-1a hash
+ * @return 1 on success, 0 on failure
+ */
+int file_hash(const char *path, unsigned long long *hash);
+
 /**
  * @brief Converts an image to PNM format using ImageMagick
  * @param input Path to input image file
@@ -145,6 +328,51 @@ long get_raw_size(const char *pnm);
  */
 int convert_to_pnm(const char *input, const char *output);
 
+/**
+ * @brief Runs the codec daemon on a Unix domain socket until SIGINT/SIGTERM
+ *
+ * Each request is an 8-byte header (op, flags, streams, level, u32
+ * little-endian payload length) followed by the inline payload, or by
+ * nothing when DAEMON_FLAG_FD is set and a descriptor is attached. Each
+ * response is a u32 status (0 on success) and a u32 length followed by the
+ * payload. Connections stay open for further requests. The level byte
+ * is the number of pyramid levels when encoding and the reduction factor
+ * when decoding (0 for the defaults). Connections are polled by one event
+ * loop and each request is handed to the worker pool; when the request
+ * queue is full the status is 4 (busy). Reads and writes time out after
+ * 10 seconds.
+ *
+ * @param socket_path Filesystem path of the listening socket
+ * @param workers Number of worker threads (0 for one per online CPU)
+ * @param opts Pointer to Options structure (verbose logging)
+ * @return 0 on clean shutdown, 1 on failure
+ */
+int serve_daemon(const char *socket_path, int workers, Options *opts);
+
+/**
+ * @brief Converts a PNM image to DIF format through an on-disk result cache
+ *
+ * Entries are named after pnm_hash() of the input and the encoder
+ * settings; an input in another format is named after file_hash() of its
+ * bytes and converted with convert_to_pnm() only on a miss. A hit copies
+ * the stored DIF to the output and marks it as recently used; a miss
+ * encodes into the cache first. Entries are
+ * published with an atomic rename, so parallel workers never read a
+ * partial file. The cache size is kept up to date in its lock file; once
+ * it exceeds max_bytes, one worker at a time evicts the least recently
+ * used entries down to 90% of the cap.
+ *
+ * @param input Path to input image ("-" is a PNM encoded without the cache)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @param cache_dir Cache directory, created if missing
+ * @param max_bytes Size cap of the cache in bytes (0 for CACHE_DEFAULT_MAX)
+ * @param hit Receives 1 if the output came from the cache (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_cached(const char *input, const char *output, const Params *params,
+                    const char *cache_dir, long max_bytes, int *hit);
+
 /**
  * @brief Prints usage information for the program
  * @param prog Program name (typically argv[0])
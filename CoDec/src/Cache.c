@@ -0,0 +1,284 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CoDec.h"
+
+/** @brief Suffix of published cache entries */
+#define ENTRY_SUFFIX ".dif"
+/** @brief Name of the lock file serializing evictions, holding the cache size */
+#define LOCK_NAME ".lock"
+/** @brief Share of the cap left after an eviction, in percent */
+#define LOW_WATER 90
+/** @brief Age in seconds past which a temporary entry is left over by a killed process */
+#define STALE_SECONDS 3600
+
+/**
+ * @brief Cache entry seen while scanning the cache directory
+ * @var Entry::name File name inside the cache directory
+ * @var Entry::size Size in bytes
+ * @var Entry::used Last use (modification time)
+ */
+typedef struct {
+    char *name;
+    long size;
+    struct timespec used;
+} Entry;
+
+/**
+ * @brief Orders entries from the least to the most recently used
+ * @param a Pointer to the first Entry
+ * @param b Pointer to the second Entry
+ * @return Negative, zero or positive as for qsort
+ */
+static int entry_cmp(const void *a, const void *b) {
+    const struct timespec *x = &((const Entry *)a)->used, *y = &((const Entry *)b)->used;
+    if (x->tv_sec != y->tv_sec) return (x->tv_sec < y->tv_sec) ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * @brief Copies the whole content of a file to a stream
+ * @param src Source stream
+ * @param dst Destination stream
+ * @return 1 on success, 0 on failure
+ */
+static int copy_stream(FILE *src, FILE *dst) {
+    char buf[65536];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), src)) > 0) {
+        if (fwrite(buf, 1, len, dst) != len) return 0;
+    }
+    return !ferror(src);
+}
+
+/**
+ * @brief Copies a cache entry to the output path
+ *
+ * The output is written through open_output, so an existing file is only
+ * replaced by a complete copy.
+ *
+ * @param src Entry stream, positioned at its start
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param input Path to the input image, which the output must not truncate
+ * @return 1 on success, 0 on failure
+ */
+static int copy_entry(FILE *src, const char *output, const char *input) {
+    Output out;
+    if (!open_output(&out, output, input)) return 0;
+    return close_output(&out, copy_stream(src, out.fp) ? 0 : 1) == 0;
+}
+
+/**
+ * @brief Reads the running cache size stored in the lock file
+ * @param fd Lock file descriptor
+ * @return Size in bytes, or -1 if unknown
+ */
+static long read_total(int fd) {
+    char buf[32];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) return -1;
+    buf[len] = '\0';
+    char *end;
+    long total = strtol(buf, &end, 10);
+    return (end == buf || total < 0) ? -1 : total;
+}
+
+/**
+ * @brief Stores the running cache size in the lock file
+ * @param fd Lock file descriptor
+ * @param total Size in bytes
+ */
+static void write_total(int fd, long total) {
+    /* Fixed width, so that a shorter number never leaves digits behind */
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%20ld\n", total);
+    if (pwrite(fd, buf, len, 0) != len) return;
+}
+
+/**
+ * @brief Scans the cache directory and evicts the least recently used entries
+ *
+ * Entries are evicted down to LOW_WATER percent of the cap so that the
+ * next scan is only needed after that much has been added again.
+ * Temporary entries older than STALE_SECONDS were left by killed
+ * processes and are removed. Readers holding an entry open are not
+ * affected by its removal.
+ *
+ * @param dir Cache directory
+ * @param max_bytes Size cap in bytes
+ * @return Size of the remaining entries in bytes
+ */
+static long cache_scan(const char *dir, long max_bytes) {
+    char path[4096];
+    DIR *d = opendir(dir);
+    Entry *entries = NULL;
+    int count = 0, cap = 0;
+    long total = 0;
+    time_t stale = time(NULL) - STALE_SECONDS;
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        int entry = len > strlen(ENTRY_SUFFIX) && strcmp(de->d_name + len - strlen(ENTRY_SUFFIX), ENTRY_SUFFIX) == 0;
+        if (!entry && !strstr(de->d_name, ENTRY_SUFFIX ".")) continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0) continue;
+        if (!entry) {
+            if (st.st_mtime < stale) unlink(path);
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? 2 * cap : 64;
+            Entry *grown = realloc(entries, cap * sizeof(Entry));
+            if (!grown) break;
+            entries = grown;
+        }
+        entries[count].name = strdup(de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        if (!entries[count].name) break;
+        total += st.st_size;
+        count++;
+    }
+    if (d) closedir(d);
+
+    if (total > max_bytes) {
+        long target = max_bytes / 100 * LOW_WATER;
+        qsort(entries, count, sizeof(Entry), entry_cmp);
+        for (int i = 0; i < count && total > target; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0 || errno == ENOENT) total -= entries[i].size;
+        }
+    }
+    for (int i = 0; i < count; i++) free(entries[i].name);
+    free(entries);
+    return total;
+}
+
+/**
+ * @brief Accounts for a new entry and evicts if the cache exceeds its cap
+ *
+ * The running size lives in the lock file, so the directory is only
+ * scanned when the cap may have been exceeded (or the size is unknown).
+ * A replaced entry is counted twice until the next scan corrects it.
+ *
+ * @param dir Cache directory
+ * @param added Size of the new entry in bytes
+ * @param max_bytes Size cap in bytes
+ */
+static void cache_account(const char *dir, long added, long max_bytes) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, LOCK_NAME);
+    int lock = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX) != 0) { close(lock); return; }
+    long total = read_total(lock);
+    if (total >= 0) total += added;
+    if (total < 0 || total > max_bytes) total = cache_scan(dir, max_bytes);
+    write_total(lock, total);
+    close(lock);
+}
+
+/**
+ * @brief Encodes a PNM image into a new cache entry and copies it to the output
+ * @param input Path to input PNM file
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param params Encoder settings
+ * @param entry Path to the cache entry
+ * @param cache_dir Cache directory
+ * @param max_bytes Size cap of the cache in bytes
+ * @return 0 on success, 1 on failure
+ */
+static int encode_entry(const char *input, const char *output, const Params *params,
+                        const char *entry, const char *cache_dir, long max_bytes) {
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", entry);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) fchmod(fd, 0644);
+    FILE *out = (fd >= 0) ? fdopen(fd, "w+b") : NULL;
+    if (!out) {
+        if (fd >= 0) { close(fd); unlink(tmp); }
+        return pnmtodif_params(input, output, params);
+    }
+    FILE *in = fopen(input, "rb");
+    int result = in ? pnmtodif_file(in, out, params) : 1;
+    if (in) fclose(in);
+    long size = ftell(out);
+
+    /* Copied before publishing: once renamed, another worker may evict it */
+    int copied = result == 0 && fseek(out, 0, SEEK_SET) == 0 && copy_entry(out, output, input);
+    if (fclose(out) != 0) result = 1;
+
+    /* Publish atomically; a worker racing on the same key just replaces it */
+    if (result != 0 || rename(tmp, entry) != 0) {
+        unlink(tmp);
+        if (result != 0) return 1;
+    }
+    else cache_account(cache_dir, size, max_bytes);
+    return copied ? 0 : 1;
+}
+
+/**
+ * @brief Converts an image to DIF format through an on-disk result cache
+ * @param input Path to input image ("-" is a PNM encoded without the cache)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @param cache_dir Cache directory, created if missing
+ * @param max_bytes Size cap of the cache in bytes (0 for CACHE_DEFAULT_MAX)
+ * @param hit Receives 1 if the output came from the cache (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_cached(const char *input, const char *output, const Params *params,
+                    const char *cache_dir, long max_bytes, int *hit) {
+    Params defaults = { .streams = 1 };
+    unsigned long long key;
+    if (!params) params = &defaults;
+    if (max_bytes <= 0) max_bytes = CACHE_DEFAULT_MAX;
+    if (hit) *hit = 0;
+
+    /* stdin cannot be read twice */
+    if (strcmp(input, "-") == 0) return pnmtodif_params(input, output, params);
+    /* Other formats are keyed on their bytes so that a hit skips the conversion */
+    int raw = !is_pnm_file(input);
+    if (!(raw ? file_hash(input, &key) : pnm_hash(input, &key))) return 1;
+
+    /* The settings are part of the name: each one changes the coded bytes */
+    char entry[4096];
+    snprintf(entry, sizeof(entry), "%s/%016llx%s-s%dp%dz%dR%dy%d%s", cache_dir, key, raw ? "-raw" : "",
+             params->streams, params->pyramid, params->runs, params->band_rows, params->color, ENTRY_SUFFIX);
+    int usable = (mkdir(cache_dir, 0755) == 0 || errno == EEXIST);
+
+    FILE *src = usable ? fopen(entry, "rb") : NULL;
+    if (src) {
+        int copied = copy_entry(src, output, input);
+        fclose(src);
+        if (!copied) return 1;
+        utimensat(AT_FDCWD, entry, NULL, 0);
+        if (hit) *hit = 1;
+        return 0;
+    }
+
+    char pnm[] = "/tmp/codec-XXXXXX.pnm";
+    if (raw) {
+        int fd = mkstemps(pnm, 4);
+        if (fd < 0) return 1;
+        close(fd);
+        if (!convert_to_pnm(input, pnm)) { unlink(pnm); return 1; }
+        input = pnm;
+    }
+    int result = usable ? encode_entry(input, output, params, entry, cache_dir, max_bytes)
+                        : pnmtodif_params(input, output, params);
+    if (raw) unlink(pnm);
+    return result;
+}
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 
 #include <ctype.h>
 #include <stdio.h>
@@ -7,9 +8,50 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #include "CoDec.h" // On inclut le header qui contient les structures Picture, etc.
 
+/* ========================================================================
+ * DÉFINITIONS INTERNES
+ * ======================================================================== */
+
+/** @brief Shortest run of zero residuals coded as a run token */
+#define RUN_MIN 8
+/** @brief Upper bound of the bits spent per residual slot of a stream (11, 12 with run tokens) */
+#define SLOT_BITS 12
+/** @brief Rows per restart band used when an update has to start a new band layout */
+#define DEFAULT_BAND_ROWS 16
+
+/**
+ * @brief Decoded DIF header
+ * @var DifHeader::w Width of the image in pixels
+ * @var DifHeader::h Height of the image in pixels
+ * @var DifHeader::channels Number of color channels
+ * @var DifHeader::flags Extended header flags (0 for the plain DIF format)
+ * @var DifHeader::streams Number of interleaved bitstreams per segment
+ * @var DifHeader::levels Number of downsampled pyramid levels
+ * @var DifHeader::band_rows Number of rows per restart band (0 if absent)
+ * @var DifHeader::segments Number of entries of the segment table (0 if absent)
+ * @var DifHeader::quant Quantizer read from the file
+ * @var DifHeader::first First pixel (reduced values)
+ * @var DifHeader::lens Byte length of each stream, segment after segment
+ * @var DifHeader::hashes Hash of the reduced samples of each restart band
+ */
+typedef struct {
+    int w, h;
+    int channels;
+    int flags;
+    int streams;
+    int levels;
+    int band_rows;
+    int segments;
+    Quantizer quant;
+    uchar first[3];
+    unsigned int *lens;
+    unsigned long long *hashes;
+} DifHeader;
+
 
 /**
  * @brief Initializes a stream for writing bits
@@ -92,8 +134,49 @@ static int stream_bytes_used(Stream *s, uchar *buf) {
     return (bits + 7) / 8;
 }
 
+/**
+ * @brief Writes the completed bytes of a write stream to a file
+ *
+ * The pending partial byte is moved back to the start of the buffer so the
+ * stream can keep writing without growing.
+ *
+ * @param s Pointer to the Stream structure
+ * @param buf Original buffer pointer
+ * @param fp File pointer
+ * @return 1 on success, 0 on write failure
+ */
+static int stream_flush(Stream *s, uchar *buf, FILE *fp) {
+    size_t done = s->ptr - buf;
+    if (done == 0) return 1;
+    if (fwrite(buf, 1, done, fp) != done) return 0;
+    buf[0] = *s->ptr;
+    s->ptr = buf;
+    return 1;
+}
+
+/**
+ * @brief Tops up a read stream from a file without seeking
+ *
+ * Unread bytes are moved to the start of the buffer, then the rest of the
+ * buffer is filled. Does nothing while at least need bytes are buffered.
+ *
+ * @param s Pointer to the Stream structure
+ * @param buf Original buffer pointer
+ * @param size Size of the buffer in bytes
+ * @param need Number of bytes the caller is about to consume at most
+ * @param fp File pointer
+ */
+static void stream_refill(Stream *s, uchar *buf, int size, int need, FILE *fp) {
+    int left = s->end - s->ptr;
+    if (left >= need) return;
+    memmove(buf, s->ptr, left);
+    left += fread(buf + left, 1, size - left, fp);
+    s->ptr = buf;
+    s->end = buf + left;
+}
+
 /* ========================================================================
- * GESTION DES IMAGES PNM (picture_load/save restent static si non dans .h)
+ * GESTION DES IMAGES PNM (picture_read/write restent static si non dans .h)
  * ======================================================================== */
 
 /**
@@ -114,48 +197,65 @@ static void skip_whitespace_comments(FILE *fp) {
 }
 
 /**
- * @brief Loads a PNM image from file
- * @param path Path to the PNM file
- * @param pic Pointer to Picture structure to fill
+ * @brief Reads the header of a PNM image from an open stream
+ * @param fp File pointer positioned at the PNM magic number
+ * @param pic Pointer to Picture structure to fill (pixels left untouched)
  * @return 1 on success, 0 on failure
  */
-static int picture_load(const char *path, Picture *pic) {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) return 0;
+static int picture_read_header(FILE *fp, Picture *pic) {
     char magic[3] = {0};
-    if (fscanf(fp, "%2s", magic) != 1) { fclose(fp); return 0; }
+    if (fscanf(fp, "%2s", magic) != 1) return 0;
     if (strcmp(magic, "P5") == 0) pic->channels = 1;
     else if (strcmp(magic, "P6") == 0) pic->channels = 3;
-    else { fclose(fp); return 0; }
+    else return 0;
     skip_whitespace_comments(fp);
-    if (fscanf(fp, "%d %d", &pic->w, &pic->h) != 2) { fclose(fp); return 0; }
+    if (fscanf(fp, "%d %d", &pic->w, &pic->h) != 2) return 0;
+    if (pic->w <= 0 || pic->h <= 0 || pic->w > 0xFFFF || pic->h > 0xFFFF) return 0;
     int maxval;
     skip_whitespace_comments(fp);
-    if (fscanf(fp, "%d", &maxval) != 1 || maxval != 255) { fclose(fp); return 0; }
+    if (fscanf(fp, "%d", &maxval) != 1 || maxval != 255) return 0;
     fgetc(fp); 
+    return 1;
+}
+
+/**
+ * @brief Reads a PNM image from an open stream
+ * @param fp File pointer positioned at the PNM magic number
+ * @param pic Pointer to Picture structure to fill
+ * @return 1 on success, 0 on failure
+ */
+static int picture_read(FILE *fp, Picture *pic) {
+    if (!picture_read_header(fp, pic)) return 0;
     int total = pic->w * pic->h * pic->channels;
     pic->pixels = malloc(total);
-    if (!pic->pixels) { fclose(fp); return 0; }
-    if (fread(pic->pixels, 1, total, fp) != (size_t)total) { free(pic->pixels); fclose(fp); return 0; }
-    fclose(fp);
+    if (!pic->pixels) return 0;
+    if (fread(pic->pixels, 1, total, fp) != (size_t)total) { free(pic->pixels); pic->pixels = NULL; return 0; }
     return 1;
 }
 
 /**
- * @brief Saves a PNM image to file
- * @param path Path to save the PNM file
- * @param pic Pointer to Picture structure
+ * @brief Loads a PNM image from file
+ * @param path Path to the PNM file
+ * @param pic Pointer to Picture structure to fill
  * @return 1 on success, 0 on failure
  */
-static int picture_save(const char *path, Picture *pic) {
-    FILE *fp = fopen(path, "wb");
+static int picture_load(const char *path, Picture *pic) {
+    FILE *fp = fopen(path, "rb");
     if (!fp) return 0;
-    const char *magic = (pic->channels == 3) ? "P6" : "P5";
-    fprintf(fp, "%s\n%d %d\n255\n", magic, pic->w, pic->h);
-    int total = pic->w * pic->h * pic->channels;
-    if (fwrite(pic->pixels, 1, total, fp) != (size_t)total) { fclose(fp); return 0; }
+    int ok = picture_read(fp, pic);
     fclose(fp);
-    return 1;
+    return ok;
+}
+
+/**
+ * @brief Writes the header of a PNM image to an open stream
+ * @param fp File pointer
+ * @param pic Pointer to Picture structure (pixels unused)
+ * @return 1 on success, 0 on failure
+ */
+static int picture_write_header(FILE *fp, Picture *pic) {
+    const char *magic = (pic->channels == 3) ? "P6" : "P5";
+    return fprintf(fp, "%s\n%d %d\n255\n", magic, pic->w, pic->h) > 0;
 }
 
 /**
@@ -257,11 +357,25 @@ static int encode_value(Stream *s, uchar val) {
 /**
  * @brief Decodes a value from stream with quantization
  * @param s Pointer to the Stream structure
- * @param val Pointer to store the decoded value
+ * @param val Pointer to store the decoded value (may exceed 255, see run_escape)
  * @param q Pointer to Quantizer configuration
  * @return 1 on success, 0 on failure
  */
-static int decode_value(Stream *s, uchar *val, Quantizer *q) {
+static int decode_value(Stream *s, unsigned int *val, Quantizer *q) {
+    if (s->end - s->ptr >= 3) {
+        /* Fast path: prefix and payload fit in a 24-bit window */
+        unsigned int win = ((unsigned int)s->ptr[0] << 24 | s->ptr[1] << 16 | s->ptr[2] << 8) << s->bitpos;
+        int lvl = __builtin_clz(~win | 0x1FFFFFFFu);
+        int plen = (lvl < 3) ? lvl + 1 : 3;
+        int nbits = q->bits[lvl];
+        if (nbits > 0 && plen + nbits <= 17) {
+            *val = ((win << plen) >> (32 - nbits)) + q->bounds[lvl];
+            int used = s->bitpos + plen + nbits;
+            s->ptr += used >> 3;
+            s->bitpos = used & 7;
+            return 1;
+        }
+    }
     unsigned int bit;
     int level;
     if (!stream_read_bits(s, 1, &bit)) return 0;
@@ -280,8 +394,59 @@ static int decode_value(Stream *s, uchar *val, Quantizer *q) {
     return 1;
 }
 
+/**
+ * @brief Gets the value announcing a run of zero residuals
+ *
+ * This is the last code of the last quantization level. Zigzag encoded
+ * residuals never exceed 254, so it is otherwise unused.
+ *
+ * @param q Pointer to Quantizer configuration
+ * @return Escape value as returned by decode_value
+ */
+static unsigned int run_escape(Quantizer *q) {
+    return q->bounds[q->levels - 1] + (1u << q->bits[q->levels - 1]) - 1;
+}
+
+/**
+ * @brief Encodes a run of zero residuals
+ *
+ * The escape value is followed by the run length minus RUN_MIN as an
+ * order-0 exponential Golomb code.
+ *
+ * @param s Pointer to the Stream structure
+ * @param len Run length (at least RUN_MIN)
+ * @return 1 on success, 0 on failure
+ */
+static int encode_run(Stream *s, int len) {
+    int level = NUM_LEVELS - 1;
+    unsigned int x = len - RUN_MIN + 1;
+    int nbits = 32 - __builtin_clz(x);
+    if (!stream_write_bits(s, prefix_code(level), prefix_length(level))) return 0;
+    if (!stream_write_bits(s, (1u << level_bits(level)) - 1, level_bits(level))) return 0;
+    if (!stream_write_bits(s, 0, nbits - 1)) return 0;
+    return stream_write_bits(s, x, nbits);
+}
+
+/**
+ * @brief Decodes the length of a run once its escape value has been read
+ * @param s Pointer to the Stream structure
+ * @param len Pointer to store the run length
+ * @return 1 on success, 0 on failure
+ */
+static int decode_run(Stream *s, int *len) {
+    int zeros = 0;
+    unsigned int bit, rest = 0;
+    do {
+        if (!stream_read_bits(s, 1, &bit)) return 0;
+    } while (bit == 0 && ++zeros <= 24);
+    if (zeros > 24) return 0;
+    if (zeros > 0 && !stream_read_bits(s, zeros, &rest)) return 0;
+    *len = (int)(((1u << zeros) | rest) - 1) + RUN_MIN;
+    return 1;
+}
+
 /* ========================================================================
- * EN-TÊTE DIF ET FONCTIONS PUBLIQUES
+ * EN-TÊTE DIF ET FLUX ENTRELACÉS
  * ======================================================================== */
 
 /**
@@ -309,99 +474,1090 @@ static int read_u16(FILE *fp, unsigned short *val) {
 }
 
 
+/**
+ * @brief Writes a 32-bit unsigned integer to file in little-endian format
+ * @param fp File pointer
+ * @param val Value to write
+ * @return 1 on success, 0 on failure
+ */
+static int write_u32(FILE *fp, unsigned int val) {
+    uchar bytes[4] = {val & 0xFF, (val >> 8) & 0xFF, (val >> 16) & 0xFF, (val >> 24) & 0xFF};
+    return fwrite(bytes, 1, 4, fp) == 4;
+}
+
+/**
+ * @brief Reads a 32-bit unsigned integer from file in little-endian format
+ * @param fp File pointer
+ * @param val Pointer to store the read value
+ * @return 1 on success, 0 on failure
+ */
+static int read_u32(FILE *fp, unsigned int *val) {
+    uchar bytes[4];
+    if (fread(bytes, 1, 4, fp) != 4) return 0;
+    *val = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+    return 1;
+}
+
+/**
+ * @brief Decodes residuals spread round-robin over several bitstreams
+ *
+ * Residual k lives in stream k % n. The streams are walked one group of n
+ * symbols at a time so that the n prefix decodes of a group do not depend
+ * on each other and can overlap in the pipeline. A run token stands for
+ * all the residuals it covers, the next token being in the stream of the
+ * residual that follows the run.
+ *
+ * @param s Array of n read streams
+ * @param n Number of streams
+ * @param phase Stream holding the first residual to decode
+ * @param sym Array receiving the decoded zigzag values
+ * @param count Number of residuals to decode
+ * @param q Pointer to Quantizer configuration
+ * @param runs 1 if the payload may contain runs of zero residuals
+ * @return 1 on success, 0 on failure
+ */
+static int decode_interleaved(Stream *s, int n, int phase, uchar *sym, int count, Quantizer *q, int runs) {
+    unsigned int v;
+    if (runs) {
+        unsigned int escape = run_escape(q);
+        for (int k = 0, j = phase; k < count; ) {
+            if (!decode_value(&s[j], &v, q)) return 0;
+            int len = 1;
+            if (v == escape) {
+                if (!decode_run(&s[j], &len) || len > count - k) return 0;
+                memset(sym + k, 0, len);
+            } else {
+                sym[k] = v;
+            }
+            k += len;
+            j = (j + len) % n;
+        }
+        return 1;
+    }
+    int k = 0;
+    for (; phase != 0 && k < count; k++) {
+        if (!decode_value(&s[phase], &v, q)) return 0;
+        sym[k] = v;
+        if (++phase == n) phase = 0;
+    }
+    for (; k + n <= count; k += n) {
+        for (int j = 0; j < n; j++) {
+            if (!decode_value(&s[j], &v, q)) return 0;
+            sym[k + j] = v;
+        }
+    }
+    for (int j = 0; k < count; j++, k++) {
+        if (!decode_value(&s[j], &v, q)) return 0;
+        sym[k] = v;
+    }
+    return 1;
+}
+
+/**
+ * @brief Codes residuals, residual k going to stream (phase + k) % n
+ *
+ * With runs enabled, RUN_MIN or more consecutive zero residuals are coded
+ * as one run token in the stream of the first of them.
+ *
+ * @param streams Array of n write streams
+ * @param n Number of streams
+ * @param phase Stream receiving the first residual
+ * @param sym Zigzag encoded residuals
+ * @param count Number of residuals
+ * @param runs 1 to code runs of zero residuals
+ * @return 1 on success, 0 on failure
+ */
+static int encode_symbols(Stream *streams, int n, int phase, const uchar *sym, int count, int runs) {
+    for (int k = 0, j = phase; k < count; ) {
+        int len = 1;
+        if (runs && sym[k] == 0) {
+            while (k + len < count && sym[k + len] == 0) len++;
+        }
+        if (len >= RUN_MIN) {
+            if (!encode_run(&streams[j], len)) return 0;
+        } else {
+            len = 1;
+            if (!encode_value(&streams[j], sym[k])) return 0;
+        }
+        k += len;
+        j = (j + len) % n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Codes residuals round-robin over n freshly allocated write streams
+ *
+ * Runs never cross a row, matching the row by row decoder.
+ *
+ * @param sym Zigzag encoded residuals
+ * @param count Number of residuals
+ * @param rowsize Number of residuals per row
+ * @param n Number of streams
+ * @param runs 1 to code runs of zero residuals
+ * @param bufs Receives the n stream buffers (freed by the caller)
+ * @param lens Receives the n stream lengths in bytes
+ * @return 1 on success, 0 on failure
+ */
+static int encode_interleaved(const uchar *sym, long count, int rowsize, int n, int runs, uchar **bufs, unsigned int *lens) {
+    long bufsize = ((count / n + 1) * SLOT_BITS + 7) / 8 + 16;
+    Stream streams[MAX_STREAMS];
+    int ok = 1;
+    for (int j = 0; j < n; j++) {
+        bufs[j] = calloc(bufsize, 1);
+        if (!bufs[j]) ok = 0;
+        else stream_init_write(&streams[j], bufs[j], bufsize);
+    }
+    for (long k = 0; k < count && ok; k += rowsize) {
+        int len = (count - k < rowsize) ? count - k : rowsize;
+        ok = encode_symbols(streams, n, k % n, sym + k, len, runs);
+    }
+    for (int j = 0; j < n && ok; j++) lens[j] = stream_bytes_used(&streams[j], bufs[j]);
+    return ok;
+}
+
+/**
+ * @brief Writes a DIF header, including the segment table and first pixel
+ * @param out File pointer
+ * @param hd Pointer to the header to write (quantizer taken from level_bits)
+ * @return 1 on success, 0 on failure
+ */
+static int write_header(FILE *out, DifHeader *hd) {
+    unsigned short magic = (hd->channels == 3) ? MAGIC_RGB : MAGIC_GRAY;
+    if (hd->flags) magic = (hd->channels == 3) ? MAGIC_RGB_EXT : MAGIC_GRAY_EXT;
+    if (!write_u16(out, magic) || !write_u16(out, hd->w) || !write_u16(out, hd->h)) return 0;
+    uchar nl = NUM_LEVELS; fwrite(&nl, 1, 1, out);
+    for(int i=0; i<NUM_LEVELS; i++) { uchar b = level_bits(i); fwrite(&b, 1, 1, out); }
+    if (hd->flags) { uchar f = hd->flags; fwrite(&f, 1, 1, out); }
+    if (hd->flags & DIF_FLAG_STREAMS) { uchar ns = hd->streams; fwrite(&ns, 1, 1, out); }
+    if (hd->flags & DIF_FLAG_PYRAMID) { uchar nlv = hd->levels; fwrite(&nlv, 1, 1, out); }
+    if (hd->flags & DIF_FLAG_RESTART) write_u16(out, hd->band_rows);
+    for (int i = 0; i < hd->segments * hd->streams; i++) write_u32(out, hd->lens[i]);
+    for (int i = 0; (hd->flags & DIF_FLAG_RESTART) && i < hd->segments; i++) {
+        write_u32(out, (unsigned int)hd->hashes[i]);
+        write_u32(out, (unsigned int)(hd->hashes[i] >> 32));
+    }
+    fwrite(hd->first, 1, hd->channels, out);
+    return !ferror(out);
+}
+
+/**
+ * @brief Releases the tables of a header filled by read_header
+ * @param hd Pointer to the header
+ */
+static void header_free(DifHeader *hd) {
+    free(hd->lens); free(hd->hashes);
+    hd->lens = NULL; hd->hashes = NULL;
+}
+
+/**
+ * @brief Gets a dimension of a pyramid level
+ * @param dim Full resolution width or height
+ * @param level Pyramid level (0 for full resolution)
+ * @return Dimension rounded up
+ */
+static int level_dim(int dim, int level) {
+    return (dim + (1 << level) - 1) >> level;
+}
+
+/**
+ * @brief Largest size a coded stream of a segment can have
+ * @param samples Number of residuals of the segment
+ * @return Size in bytes
+ */
+static size_t stream_bound(long samples) {
+    return (size_t)samples * SLOT_BITS / 8 + 16;
+}
+
+/**
+ * @brief Counts the residuals coded in a segment
+ * @param hd Pointer to the header
+ * @param seg Segment index (a restart band, or a pyramid level from the coarsest)
+ * @return Number of residuals
+ */
+static long segment_samples(const DifHeader *hd, int seg) {
+    if (hd->band_rows > 0) {
+        int rows = ((seg + 1) * hd->band_rows < hd->h) ? hd->band_rows : hd->h - seg * hd->band_rows;
+        return (long)rows * hd->w * hd->channels;
+    }
+    int k = hd->levels - seg;
+    return (long)level_dim(hd->w, k) * level_dim(hd->h, k) * hd->channels;
+}
+
+/**
+ * @brief Reads a DIF header, including the segment table and first pixel
+ * @param in File pointer
+ * @param hd Pointer to the header to fill (released by the caller with header_free)
+ * @return 1 on success, 0 on failure
+ */
+static int read_header(FILE *in, DifHeader *hd) {
+    unsigned short magic, w16, h16;
+    memset(hd, 0, sizeof(*hd));
+    if (!read_u16(in, &magic) || !read_u16(in, &w16) || !read_u16(in, &h16)) return 0;
+    int ext = (magic == MAGIC_GRAY_EXT || magic == MAGIC_RGB_EXT);
+    if (!ext && magic != MAGIC_GRAY && magic != MAGIC_RGB) return 0;
+    hd->channels = (magic == MAGIC_RGB || magic == MAGIC_RGB_EXT) ? 3 : 1;
+    hd->w = w16; hd->h = h16;
+    if (hd->w == 0 || hd->h == 0) return 0;
+    uchar nl;
+    if (fread(&nl, 1, 1, in) != 1 || nl < 1 || nl > NUM_LEVELS) return 0;
+    Quantizer *q = &hd->quant;
+    q->levels = nl;
+    q->bounds[0] = 0;
+    for(int i=0; i<nl; i++) { 
+        uchar b; if (fread(&b, 1, 1, in) != 1) return 0; q->bits[i] = b; 
+        if(i>0) q->bounds[i] = q->bounds[i-1] + (1 << q->bits[i-1]);
+    }
+
+    uchar byte;
+    hd->streams = 1;
+    if (ext) { if (fread(&byte, 1, 1, in) != 1) return 0; hd->flags = byte; }
+    if (hd->flags & DIF_FLAG_STREAMS) {
+        if (fread(&byte, 1, 1, in) != 1 || byte < 1 || byte > MAX_STREAMS) return 0;
+        hd->streams = byte;
+    }
+    if (hd->flags & DIF_FLAG_PYRAMID) {
+        if (fread(&byte, 1, 1, in) != 1 || byte < 1 || byte > MAX_LEVELS) return 0;
+        hd->levels = byte;
+    }
+    if (hd->flags & DIF_FLAG_RESTART) {
+        unsigned short rows;
+        if ((hd->flags & DIF_FLAG_PYRAMID) || !read_u16(in, &rows) || rows == 0) return 0;
+        hd->band_rows = rows;
+        hd->segments = (hd->h + rows - 1) / rows;
+    }
+    else if (hd->flags & (DIF_FLAG_STREAMS | DIF_FLAG_PYRAMID)) hd->segments = hd->levels + 1;
+    if (hd->segments > 0) {
+        hd->lens = malloc((long)hd->segments * hd->streams * sizeof(unsigned int));
+        if (!hd->lens) return 0;
+        /* Lengths are checked before any payload buffer is sized from them */
+        for (int i = 0; i < hd->segments * hd->streams; i++) {
+            if (!read_u32(in, &hd->lens[i]) || hd->lens[i] > stream_bound(segment_samples(hd, i / hd->streams))) {
+                header_free(hd);
+                return 0;
+            }
+        }
+    }
+    if (hd->flags & DIF_FLAG_RESTART) {
+        hd->hashes = malloc(hd->segments * sizeof(unsigned long long));
+        if (!hd->hashes) { header_free(hd); return 0; }
+        for (int i = 0; i < hd->segments; i++) {
+            unsigned int lo, hi;
+            if (!read_u32(in, &lo) || !read_u32(in, &hi)) { header_free(hd); return 0; }
+            hd->hashes[i] = ((unsigned long long)hi << 32) | lo;
+        }
+    }
+    if (fread(hd->first, 1, hd->channels, in) != (size_t)hd->channels) { header_free(hd); return 0; }
+    return 1;
+}
+
+
+/**
+ * @brief Reads one segment of the payload and sets up its streams
+ * @param in File pointer positioned at the segment
+ * @param hd Pointer to the header holding the segment table
+ * @param seg Segment index
+ * @param s Array receiving hd->streams read streams
+ * @return Buffer backing the streams (freed by the caller), or NULL on failure
+ */
+static uchar *read_segment(FILE *in, DifHeader *hd, int seg, Stream *s) {
+    unsigned int *lens = hd->lens + seg * hd->streams;
+    size_t size = 0, got = 0, cap = 0;
+    for (int j = 0; j < hd->streams; j++) size += lens[j];
+    /* Grown as bytes arrive, so that a short file cannot claim a huge buffer */
+    uchar *comp = NULL;
+    do {
+        cap = cap ? 2 * cap : 65536;
+        if (cap > size) cap = size;
+        uchar *grown = realloc(comp, cap + 1);
+        if (!grown || fread(grown + got, 1, cap - got, in) != cap - got) { free(grown ? grown : comp); return NULL; }
+        comp = grown;
+        got = cap;
+    } while (got < size);
+    size_t offset = 0;
+    for (int j = 0; j < hd->streams; j++) {
+        stream_init_read(&s[j], comp + offset, lens[j]);
+        offset += lens[j];
+    }
+    return comp;
+}
+
+/* ========================================================================
+ * DÉCORRÉLATION DES COULEURS
+ * ======================================================================== */
+
+/*
+ * The color loops read interleaved R, G, B bytes, which vectorizes only with
+ * byte shuffles: SSSE3 on x86-64 (chosen at load time when the CPU has it),
+ * while NEON has them in its baseline. Choosing at load time needs ifunc
+ * support, i.e. glibc; other toolchains get the plain definition.
+ */
+#if defined(__has_attribute)
+#if __has_attribute(target_clones) && defined(__GLIBC__) && defined(__x86_64__)
+#define VECTOR_CLONES __attribute__((target_clones("default", "ssse3")))
+#endif
+#endif
+#ifndef VECTOR_CLONES
+#define VECTOR_CLONES
+#endif
+
+/**
+ * @brief Sign-extends a value modulo 128 to the range -64..63
+ * @param v Value (only the 7 low bits are used)
+ * @return Signed value congruent to v modulo 128
+ */
+static inline int wrap7(int v) {
+    return ((v & 127) ^ 64) - 64;
+}
+
+/**
+ * @brief Halves a value modulo 128 read as a signed 7-bit number
+ *
+ * Computed on bytes (the sign bit is moved to bit 7) so that the color
+ * loops below only need 8-bit vector lanes.
+ *
+ * @param v Value (0-127)
+ * @return floor(wrap7(v) / 2), as a byte
+ */
+static inline uchar half7(uchar v) {
+    return (uchar)((signed char)(v << 1) >> 2);
+}
+
+/**
+ * @brief Applies the YCoCg-R lifting to reduced RGB samples, in place
+ *
+ * The lifting steps are computed modulo 128 so that Y, Co and Cg stay
+ * 7-bit values like the reduced samples; each step only adds a function
+ * of another component, so it is exactly reversible. The loop is branch
+ * free on bytes so that the compiler vectorizes it (see VECTOR_CLONES;
+ * makelib builds with the dynamic cost model needed at -O2).
+ *
+ * @param px Interleaved R, G, B samples (0-127), replaced by Y, Co, Cg
+ * @param count Number of pixels
+ */
+VECTOR_CLONES static void color_forward(uchar *restrict px, long count) {
+    for (long i = 0; i < count; i++) {
+        uchar r = px[3 * i], g = px[3 * i + 1], b = px[3 * i + 2];
+        uchar co = (r - b) & 127;
+        uchar t = (b + half7(co)) & 127;
+        uchar cg = (g - t) & 127;
+        px[3 * i] = (t + half7(cg)) & 127;
+        px[3 * i + 1] = co;
+        px[3 * i + 2] = cg;
+    }
+}
+
+/**
+ * @brief Inverts color_forward
+ * @param src Interleaved Y, Co, Cg samples
+ * @param dst Receives the R, G, B samples
+ * @param count Number of pixels
+ */
+VECTOR_CLONES static void color_inverse(const uchar *restrict src, uchar *restrict dst, long count) {
+    for (long i = 0; i < count; i++) {
+        uchar y = src[3 * i], co = src[3 * i + 1], cg = src[3 * i + 2];
+        uchar t = (y - half7(cg)) & 127;
+        uchar b = (t - half7(co)) & 127;
+        dst[3 * i] = (b + co) & 127;
+        dst[3 * i + 1] = (cg + t) & 127;
+        dst[3 * i + 2] = b;
+    }
+}
+
+/* ========================================================================
+ * PYRAMIDE MULTI-RÉSOLUTION
+ * ======================================================================== */
+
+/**
+ * @brief Builds a pyramid level by averaging blocks of the full image
+ *
+ * Each sample is the rounded mean of its 2^level x 2^level block, clipped
+ * at the right and bottom edges, so it matches what RowSink computes when
+ * downsampling a decoded image.
+ *
+ * @param full Full resolution reduced samples
+ * @param w Full resolution width
+ * @param h Full resolution height
+ * @param chans Number of channels
+ * @param level Pyramid level (1 to MAX_LEVELS)
+ * @param dst Receives level_dim(w) x level_dim(h) samples
+ */
+static void downsample_level(const uchar *full, int w, int h, int chans, int level, uchar *dst) {
+    int lw = level_dim(w, level), lh = level_dim(h, level), s = 1 << level;
+    for (int Y = 0; Y < lh; Y++) {
+        int y1 = (Y + 1) * s < h ? (Y + 1) * s : h;
+        for (int X = 0; X < lw; X++) {
+            int x1 = (X + 1) * s < w ? (X + 1) * s : w;
+            int cnt = (y1 - Y * s) * (x1 - X * s);
+            for (int c = 0; c < chans; c++) {
+                int sum = 0;
+                for (int y = Y * s; y < y1; y++)
+                    for (int x = X * s; x < x1; x++) sum += full[(y * w + x) * chans + c];
+                dst[(Y * lw + X) * chans + c] = (sum + cnt / 2) / cnt;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Computes the residuals of a pyramid level
+ *
+ * The coarsest level is coded differentially from zero; finer levels are
+ * coded against the coarser level upsampled by pixel replication.
+ *
+ * @param lvl Samples of the level
+ * @param coarse Samples of the next coarser level, or NULL for the coarsest
+ * @param w Level width
+ * @param h Level height
+ * @param chans Number of channels
+ * @param wrap 1 to wrap the differences modulo 128 (coarsest level only)
+ * @param sym Receives w * h * chans zigzag encoded residuals
+ */
+static void level_residuals(const uchar *lvl, const uchar *coarse, int w, int h, int chans, int wrap, uchar *sym) {
+    if (!coarse) {
+        int prev[3] = {0};
+        for (long i = 0; i < (long)w * h; i++) {
+            for (int c = 0; c < chans; c++) {
+                int current = lvl[i * chans + c];
+                sym[i * chans + c] = zigzag_encode(wrap ? wrap7(current - prev[c]) : current - prev[c]);
+                prev[c] = current;
+            }
+        }
+        return;
+    }
+    int cw = level_dim(w, 1);
+    for (int y = 0; y < h; y++) {
+        const uchar *up = coarse + (long)(y >> 1) * cw * chans;
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < chans; c++) {
+                long i = ((long)y * w + x) * chans + c;
+                sym[i] = zigzag_encode(lvl[i] - up[(x >> 1) * chans + c]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Destination of decoded rows, optionally downsampling them
+ * @var RowSink::out Output stream receiving PNM rows
+ * @var RowSink::shift Log2 of the reduction factor
+ * @var RowSink::w Width of the incoming rows
+ * @var RowSink::h Number of incoming rows
+ * @var RowSink::chans Number of channels
+ * @var RowSink::y Number of rows received so far
+ * @var RowSink::rgb Row converted back to RGB, or NULL without color transform
+ * @var RowSink::sum Block sums of the pending output row
+ * @var RowSink::row Output row buffer
+ */
+typedef struct {
+    FILE *out;
+    int shift;
+    int w, h, chans;
+    int y;
+    uchar *rgb;
+    unsigned int *sum;
+    uchar *row;
+} RowSink;
+
+/**
+ * @brief Prepares a row sink and writes the PNM header of the output image
+ * @param k Pointer to the RowSink to initialize
+ * @param out Output stream
+ * @param w Width of the incoming rows
+ * @param h Number of incoming rows
+ * @param chans Number of channels
+ * @param shift Log2 of the reduction factor
+ * @param color 1 if the rows hold Y, Co, Cg samples to convert back to RGB
+ * @return 1 on success, 0 on failure
+ */
+static int sink_init(RowSink *k, FILE *out, int w, int h, int chans, int shift, int color) {
+    k->out = out; k->shift = shift;
+    k->w = w; k->h = h; k->chans = chans; k->y = 0;
+    k->rgb = color ? malloc((long)w * chans) : NULL;
+    k->sum = calloc((long)level_dim(w, shift) * chans, sizeof(unsigned int));
+    k->row = malloc((long)level_dim(w, shift) * chans);
+    Picture pic = {level_dim(w, shift), level_dim(h, shift), chans, NULL};
+    return (!color || k->rgb) && k->sum && k->row && picture_write_header(out, &pic);
+}
+
+/**
+ * @brief Releases the buffers of a row sink
+ * @param k Pointer to the RowSink
+ */
+static void sink_free(RowSink *k) {
+    free(k->rgb); free(k->sum); free(k->row);
+}
+
+/**
+ * @brief Feeds one row of reduced samples to a row sink
+ * @param k Pointer to the RowSink
+ * @param red Row of reduced samples
+ * @return 1 on success, 0 on write failure
+ */
+static int sink_row(RowSink *k, const uchar *red) {
+    int rowsize = k->w * k->chans;
+    if (k->rgb) {
+        color_inverse(red, k->rgb, k->w);
+        red = k->rgb;
+    }
+    if (k->shift == 0) {
+        for (int i = 0; i < rowsize; i++) k->row[i] = red[i] << 1;
+        return fwrite(k->row, 1, rowsize, k->out) == (size_t)rowsize;
+    }
+    int ow = level_dim(k->w, k->shift), s = 1 << k->shift;
+    for (int x = 0; x < k->w; x++)
+        for (int c = 0; c < k->chans; c++) k->sum[(x >> k->shift) * k->chans + c] += red[x * k->chans + c];
+    k->y++;
+    if (k->y % s != 0 && k->y != k->h) return 1;
+
+    int rows = k->y - (((k->y - 1) >> k->shift) << k->shift);
+    for (int X = 0; X < ow; X++) {
+        int cols = (X + 1) * s < k->w ? s : k->w - X * s;
+        int cnt = rows * cols;
+        for (int c = 0; c < k->chans; c++) {
+            unsigned int *sum = &k->sum[X * k->chans + c];
+            k->row[X * k->chans + c] = ((*sum + cnt / 2) / cnt) << 1;
+            *sum = 0;
+        }
+    }
+    return fwrite(k->row, 1, ow * k->chans, k->out) == (size_t)(ow * k->chans);
+}
+
+/**
+ * @brief Decodes one pyramid level row by row
+ * @param s Array of n read streams holding the level
+ * @param n Number of streams
+ * @param q Pointer to Quantizer configuration
+ * @param runs 1 if the payload may contain runs of zero residuals
+ * @param coarse Samples of the next coarser level, or NULL for the coarsest
+ * @param w Level width
+ * @param h Level height
+ * @param chans Number of channels
+ * @param dst Receives the level samples (NULL if not needed)
+ * @param sink Receives the decoded rows (NULL if not needed)
+ * @return 1 on success, 0 on failure
+ */
+static int decode_level(Stream *s, int n, Quantizer *q, int runs, const uchar *coarse, int w, int h, int chans,
+                        uchar *dst, RowSink *sink) {
+    int rowsize = w * chans, cw = level_dim(w, 1), phase = 0, ok = 1;
+    int prev[3] = {0};
+    uchar *sym = malloc(rowsize);
+    uchar *tmp = dst ? NULL : malloc(rowsize);
+    if (!sym || (!dst && !tmp)) ok = 0;
+    for (int y = 0; y < h && ok; y++) {
+        uchar *row = dst ? dst + (long)y * rowsize : tmp;
+        if (!decode_interleaved(s, n, phase, sym, rowsize, q, runs)) { ok = 0; break; }
+        phase = (phase + rowsize) % n;
+        if (!coarse) {
+            for (int x = 0, k = 0; x < w; x++) {
+                for (int c = 0; c < chans; c++, k++) {
+                    /* Differences wrap modulo 128 with the color transform */
+                    int current = (prev[c] + zigzag_decode(sym[k])) & 127;
+                    prev[c] = current;
+                    row[k] = current;
+                }
+            }
+        } else {
+            const uchar *up = coarse + (long)(y >> 1) * cw * chans;
+            for (int x = 0, k = 0; x < w; x++)
+                for (int c = 0; c < chans; c++, k++) row[k] = up[(x >> 1) * chans + c] + zigzag_decode(sym[k]);
+        }
+        if (sink && !sink_row(sink, row)) ok = 0;
+    }
+    free(sym); free(tmp);
+    return ok;
+}
+
+/**
+ * @brief Encodes a full image with its pyramid levels, coarsest level first
+ * @param in Input stream positioned at the PNM pixels
+ * @param out Output stream receiving the DIF file
+ * @param hd Pointer to the header to write (dimensions, flags, streams, levels)
+ * @return 0 on success, 1 on failure
+ */
+static int encode_pyramid(FILE *in, FILE *out, DifHeader *hd) {
+    int n = hd->streams, chans = hd->channels, L = hd->levels;
+    long total = (long)hd->w * hd->h * chans;
+    uchar *lvl[MAX_LEVELS + 1] = {0};
+    uchar *bufs[(MAX_LEVELS + 1) * MAX_STREAMS] = {0};
+    unsigned int lens[(MAX_LEVELS + 1) * MAX_STREAMS];
+    uchar *sym = malloc(total);
+    lvl[0] = malloc(total);
+    int ok = sym && lvl[0] && fread(lvl[0], 1, total, in) == (size_t)total;
+    if (ok) for (long i = 0; i < total; i++) lvl[0][i] >>= 1;
+
+    for (int k = 1; k <= L && ok; k++) {
+        lvl[k] = malloc((long)level_dim(hd->w, k) * level_dim(hd->h, k) * chans);
+        if (!lvl[k]) ok = 0;
+        else downsample_level(lvl[0], hd->w, hd->h, chans, k, lvl[k]);
+    }
+    for (int seg = 0; seg <= L && ok; seg++) {
+        int k = L - seg, lw = level_dim(hd->w, k), lh = level_dim(hd->h, k);
+        level_residuals(lvl[k], (k < L) ? lvl[k + 1] : NULL, lw, lh, chans, 0, sym);
+        ok = encode_interleaved(sym, (long)lw * lh * chans, lw * chans, n, hd->flags & DIF_FLAG_RUNS,
+                                &bufs[seg * n], &lens[seg * n]);
+    }
+
+    if (ok) {
+        hd->segments = L + 1;
+        hd->lens = lens;
+        for (int c = 0; c < chans; c++) hd->first[c] = lvl[0][c];
+        ok = write_header(out, hd);
+        hd->lens = NULL;
+    }
+    for (int i = 0; i < (L + 1) * n && ok; i++) {
+        if (fwrite(bufs[i], 1, lens[i], out) != lens[i]) ok = 0;
+    }
+
+    for (int i = 0; i < (L + 1) * n; i++) free(bufs[i]);
+    for (int k = 0; k <= L; k++) free(lvl[k]);
+    free(sym);
+    return (ok && fflush(out) == 0 && !ferror(out)) ? 0 : 1;
+}
+
+/* ========================================================================
+ * BANDES INDÉPENDANTES ET MISE À JOUR INCRÉMENTALE
+ * ======================================================================== */
+
+/** @brief FNV-1a offset basis */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+/** @brief FNV-1a prime */
+#define FNV_PRIME  0x100000001b3ULL
+
+/**
+ * @brief Hashes a buffer with 64-bit FNV-1a
+ * @param buf Bytes to hash
+ * @param size Number of bytes
+ * @param h Running hash (FNV_OFFSET to start)
+ * @return Updated hash
+ */
+static unsigned long long hash_bytes(const uchar *buf, long size, unsigned long long h) {
+    for (long i = 0; i < size; i++) {
+        h ^= buf[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * @brief Encodes an image as bands of rows coded independently
+ *
+ * Each band restarts the differential predictor from zero and is hashed on
+ * its reduced samples. When a previous file with the same layout is given,
+ * its segments are read in order and the ones whose band hash still
+ * matches are copied through untouched; only the other bands are coded.
+ *
+ * @param in Input stream positioned at the PNM pixels
+ * @param out Output stream receiving the DIF file
+ * @param hd Pointer to the header to write (dimensions, flags, streams, band_rows)
+ * @param prev Previous DIF stream positioned at its payload, or NULL
+ * @param old Header of the previous file, or NULL
+ * @param recoded Receives the number of bands coded (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+static int encode_bands(FILE *in, FILE *out, DifHeader *hd, FILE *prev, DifHeader *old, int *recoded) {
+    int n = hd->streams, chans = hd->channels, rows = hd->band_rows;
+    int rowsize = hd->w * chans, nb = (hd->h + rows - 1) / rows, coded = 0;
+    int color = (hd->flags & DIF_FLAG_COLOR) != 0;
+    long bandsize = (long)rows * rowsize;
+    uchar **bufs = calloc((long)nb * n, sizeof(uchar *));
+    unsigned int *lens = calloc((long)nb * n, sizeof(unsigned int));
+    unsigned long long *hashes = malloc(nb * sizeof(unsigned long long));
+    uchar *band = malloc(bandsize);
+    uchar *sym = malloc(bandsize);
+    int ok = bufs && lens && hashes && band && sym;
+
+    for (int b = 0; b < nb && ok; b++) {
+        int bh = ((b + 1) * rows < hd->h) ? rows : hd->h - b * rows;
+        long size = (long)bh * rowsize;
+        uchar **seg = &bufs[(long)b * n];
+        if (fread(band, 1, size, in) != (size_t)size) { ok = 0; break; }
+        for (long i = 0; i < size; i++) band[i] >>= 1;
+        if (color) color_forward(band, size / 3);
+        if (b == 0) for (int c = 0; c < chans; c++) hd->first[c] = band[c];
+        hashes[b] = hash_bytes(band, size, FNV_OFFSET);
+
+        if (old) {
+            /* The previous segment has to be consumed even if it is replaced */
+            for (int j = 0; j < n && ok; j++) {
+                size_t len = old->lens[b * n + j];
+                lens[b * n + j] = len;
+                seg[j] = (len <= stream_bound(size)) ? malloc(len + 1) : NULL;
+                ok = seg[j] && fread(seg[j], 1, len, prev) == len;
+            }
+            if (!ok || old->hashes[b] == hashes[b]) continue;
+            for (int j = 0; j < n; j++) { free(seg[j]); seg[j] = NULL; }
+        }
+        level_residuals(band, NULL, hd->w, bh, chans, color, sym);
+        ok = encode_interleaved(sym, size, rowsize, n, hd->flags & DIF_FLAG_RUNS, seg, &lens[b * n]);
+        coded++;
+    }
+
+    if (ok) {
+        hd->segments = nb;
+        hd->lens = lens;
+        hd->hashes = hashes;
+        ok = write_header(out, hd);
+        hd->lens = NULL;
+        hd->hashes = NULL;
+    }
+    for (long i = 0; i < (long)nb * n && ok; i++) {
+        if (fwrite(bufs[i], 1, lens[i], out) != lens[i]) ok = 0;
+    }
+    if (recoded) *recoded = coded;
+
+    for (long i = 0; bufs && i < (long)nb * n; i++) free(bufs[i]);
+    free(bufs); free(lens); free(hashes); free(band); free(sym);
+    return (ok && fflush(out) == 0 && !ferror(out)) ? 0 : 1;
+}
+
+/* ========================================================================
+ * FONCTIONS PUBLIQUES
+ * ======================================================================== */
+
+/**
+ * @brief Opens a path for the codec, "-" standing for stdin or stdout
+ * @param path Path to the file, or "-"
+ * @param mode fopen mode ("rb" or "wb")
+ * @return File pointer, or NULL on error
+ */
+static FILE *open_path(const char *path, const char *mode) {
+    if (strcmp(path, "-") == 0) return (mode[0] == 'r') ? stdin : stdout;
+    return fopen(path, mode);
+}
+
+/**
+ * @brief Closes a file opened with open_path (standard streams are only flushed)
+ * @param fp File pointer
+ * @return 0 on success, EOF on failure
+ */
+static int close_path(FILE *fp) {
+    if (fp == stdin) return 0;
+    if (fp == stdout) return fflush(fp);
+    return fclose(fp);
+}
+
 /**
  * @brief Converts a PNM image to DIF format
- * @param input Path to input PNM file
- * @param output Path to output DIF file
+ * @param input Path to input PNM file ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
  * @return 0 on success, 1 on failure
  */
 int pnmtodif(const char *input, const char *output) {
+    return pnmtodif_params(input, output, NULL);
+}
+
+/**
+ * @brief Converts a PNM image to DIF format using the given coding modes
+ * @param input Path to input PNM file ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_params(const char *input, const char *output, const Params *params) {
+    FILE *in = open_path(input, "rb");
+    if (!in) return 1;
+    Output out;
+    if (!open_output(&out, output, input)) { close_path(in); return 1; }
+    int result = pnmtodif_file(in, out.fp, params);
+    close_path(in);
+    return close_output(&out, result);
+}
+
+/**
+ * @brief Encodes a PNM image read from a stream into a DIF stream
+ *
+ * The image is read one row at a time. In single stream mode the coded
+ * bytes are written as soon as each row is done, so neither side needs to
+ * be seekable or fully buffered; multi-stream mode keeps the coded streams
+ * in memory until their lengths are known, and pyramid mode keeps the
+ * whole image. Banded mode reads one band at a time and keeps the coded
+ * bands.
+ *
+ * @param in Input stream positioned at the PNM header
+ * @param out Output stream receiving the DIF file
+ * @param params Encoder settings (NULL for the plain DIF format)
+ * @return 0 on success, 1 on failure
+ */
+int pnmtodif_file(FILE *in, FILE *out, const Params *params) {
+    DifHeader hd = {0};
+    int n = params ? params->streams : 1;
+    if (n != 1 && n != 4 && n != 8) return 1;
+    hd.streams = n;
+    hd.levels = params ? params->pyramid : 0;
+    if (hd.levels < 0 || hd.levels > MAX_LEVELS) return 1;
+    if (n > 1) hd.flags |= DIF_FLAG_STREAMS;
+    if (hd.levels > 0) hd.flags |= DIF_FLAG_PYRAMID;
+    if (params && params->runs) hd.flags |= DIF_FLAG_RUNS;
+    int color = params && params->color;
+    if (color && hd.levels > 0) return 1;
+    hd.band_rows = params ? params->band_rows : 0;
+    if (hd.band_rows < 0 || hd.band_rows > 65535 || (hd.band_rows > 0 && hd.levels > 0)) return 1;
+    if (hd.band_rows > 0) hd.flags |= DIF_FLAG_RESTART;
+    int runs = hd.flags & DIF_FLAG_RUNS;
+
     Picture pic;
-    if (!picture_load(input, &pic)) return 1;
-    int total = pic.w * pic.h * pic.channels;
-    uchar *reduced = malloc(total);
-    for (int i = 0; i < total; i++) reduced[i] = pic.pixels[i] >> 1;
-    
-    int bufsize = (total * 11 + 7) / 8 + 16;
-    uchar *buffer = calloc(bufsize, 1);
-    Stream stream;
-    stream_init_write(&stream, buffer, bufsize);
+    if (!picture_read_header(in, &pic)) return 1;
+    hd.w = pic.w; hd.h = pic.h; hd.channels = pic.channels;
+    if (color && pic.channels == 3) hd.flags |= DIF_FLAG_COLOR;
+    else color = 0;
+    if (hd.levels > 0) return encode_pyramid(in, out, &hd);
+    if (hd.band_rows > 0) return encode_bands(in, out, &hd, NULL, NULL, NULL);
+
+    int rowsize = pic.w * pic.channels;
+    uchar *row = malloc(rowsize);
+    uchar *sym = malloc(rowsize);
+    if (!row || !sym) { free(row); free(sym); return 1; }
+
+    long bufsize = (n == 1) ? (rowsize * SLOT_BITS + 7) / 8 + 16 : (((long)pic.h * rowsize / n + 1) * SLOT_BITS + 7) / 8 + 16;
+    uchar *buffers[MAX_STREAMS] = {0};
+    Stream streams[MAX_STREAMS];
+    int ok = 1, j = 0, phase = 0;
+    for (j = 0; j < n && ok; j++) {
+        buffers[j] = calloc(bufsize, 1);
+        if (buffers[j]) stream_init_write(&streams[j], buffers[j], bufsize);
+        else ok = 0;
+    }
 
     int prev[3] = {0};
-    for (int c = 0; c < pic.channels; c++) prev[c] = reduced[c];
-
-    for (int i = 1; i < pic.w * pic.h; i++) {
-        for (int c = 0; c < pic.channels; c++) {
-            int current = reduced[i * pic.channels + c];
-            uchar encoded = zigzag_encode(current - prev[c]);
-            prev[c] = current;
-            if (!encode_value(&stream, encoded)) { /* gestion erreur */ }
+    for (int y = 0; y < pic.h && ok; y++) {
+        if (fread(row, 1, rowsize, in) != (size_t)rowsize) { ok = 0; break; }
+        for (int i = 0; i < rowsize; i++) row[i] >>= 1;
+        if (color) color_forward(row, pic.w);
+        if (y == 0) {
+            for (int c = 0; c < pic.channels; c++) hd.first[c] = prev[c] = row[c];
+            if (n == 1) ok = write_header(out, &hd);
         }
+        int x0 = (y == 0) ? 1 : 0, count = (pic.w - x0) * pic.channels;
+        for (int x = x0, k = 0; x < pic.w; x++) {
+            for (int c = 0; c < pic.channels; c++, k++) {
+                int current = row[x * pic.channels + c];
+                sym[k] = zigzag_encode(color ? wrap7(current - prev[c]) : current - prev[c]);
+                prev[c] = current;
+            }
+        }
+        if (ok) ok = encode_symbols(streams, n, phase, sym, count, runs);
+        phase = (phase + count) % n;
+        if (n == 1 && ok) ok = stream_flush(&streams[0], buffers[0], out);
     }
 
-    FILE *out = fopen(output, "wb");
-    write_u16(out, (pic.channels == 3) ? MAGIC_RGB : MAGIC_GRAY);
-    write_u16(out, pic.w);
-    write_u16(out, pic.h);
-    uchar nl = NUM_LEVELS; fwrite(&nl, 1, 1, out);
-    for(int i=0; i<NUM_LEVELS; i++) { uchar b = level_bits(i); fwrite(&b, 1, 1, out); }
-    
-    fwrite(reduced, 1, pic.channels, out);
-    fwrite(buffer, 1, stream_bytes_used(&stream, buffer), out);
+    if (ok && n > 1) {
+        unsigned int lens[MAX_STREAMS];
+        for (j = 0; j < n; j++) lens[j] = stream_bytes_used(&streams[j], buffers[j]);
+        hd.segments = 1;
+        hd.lens = lens;
+        ok = write_header(out, &hd);
+    }
+    for (j = 0; j < n && ok; j++) {
+        size_t used = stream_bytes_used(&streams[j], buffers[j]);
+        if (fwrite(buffers[j], 1, used, out) != used) ok = 0;
+    }
     
-    fclose(out); free(buffer); free(reduced); picture_free(&pic);
-    return 0;
+    for (j = 0; j < n; j++) free(buffers[j]);
+    free(row); free(sym);
+    return (ok && fflush(out) == 0 && !ferror(out)) ? 0 : 1;
+}
+
+/**
+ * @brief Updates a banded DIF file for a new version of its image
+ * @param previous Path to the previous DIF file
+ * @param input Path to the new PNM image ("-" for stdin)
+ * @param output Path to output DIF file ("-" for stdout)
+ * @param recoded Receives the number of bands coded (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int difupdate(const char *previous, const char *input, const char *output, int *recoded) {
+    FILE *prev = fopen(previous, "rb");
+    if (!prev) return 1;
+    FILE *in = open_path(input, "rb");
+    if (!in) { fclose(prev); return 1; }
+
+    /* The output may replace the previous file */
+    Output out;
+    if (!open_output(&out, output, previous)) { fclose(prev); close_path(in); return 1; }
+
+    int result = difupdate_file(prev, in, out.fp, recoded);
+    fclose(prev);
+    close_path(in);
+    return close_output(&out, result);
+}
+
+/**
+ * @brief Updates a banded DIF stream for a new version of its image
+ *
+ * The bands are spliced only if the previous file has the same size and
+ * was coded with bands and the standard quantizer; its streams, runs and
+ * color settings are kept either way.
+ *
+ * @param prev Previous DIF stream positioned at its header
+ * @param in Input stream positioned at the PNM header
+ * @param out Output stream receiving the DIF file
+ * @param recoded Receives the number of bands coded (may be NULL)
+ * @return 0 on success, 1 on failure
+ */
+int difupdate_file(FILE *prev, FILE *in, FILE *out, int *recoded) {
+    DifHeader old, hd = {0};
+    Picture pic;
+    if (!read_header(prev, &old)) return 1;
+    if (!picture_read_header(in, &pic)) { header_free(&old); return 1; }
+
+    int splice = (old.flags & DIF_FLAG_RESTART) && old.w == pic.w && old.h == pic.h
+                 && old.channels == pic.channels && old.quant.levels == NUM_LEVELS;
+    for (int i = 0; i < old.quant.levels && splice; i++) {
+        if (old.quant.bits[i] != level_bits(i)) splice = 0;
+    }
+
+    hd.w = pic.w; hd.h = pic.h; hd.channels = pic.channels;
+    hd.streams = old.streams;
+    hd.band_rows = splice ? old.band_rows : DEFAULT_BAND_ROWS;
+    hd.flags = DIF_FLAG_RESTART | (old.flags & (DIF_FLAG_STREAMS | DIF_FLAG_RUNS));
+    if (pic.channels == 3) hd.flags |= old.flags & DIF_FLAG_COLOR;
+    int result = encode_bands(in, out, &hd, splice ? prev : NULL, splice ? &old : NULL, recoded);
+    header_free(&old);
+    return result;
 }
 
 /**
  * @brief Converts a DIF image to PNM format
- * @param input Path to input DIF file
- * @param output Path to output PNM file
+ * @param input Path to input DIF file ("-" for stdin)
+ * @param output Path to output PNM file ("-" for stdout)
  * @return 0 on success, 1 on failure
  */
 int diftopnm(const char *input, const char *output) {
-    FILE *in = fopen(input, "rb");
+    return diftopnm_scaled(input, output, 1);
+}
+
+/**
+ * @brief Converts a DIF image to a reduced-size PNM image
+ * @param input Path to input DIF file ("-" for stdin)
+ * @param output Path to output PNM file ("-" for stdout)
+ * @param scale Reduction factor (1, 2, 4 or 8)
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_scaled(const char *input, const char *output, int scale) {
+    FILE *in = open_path(input, "rb");
     if (!in) return 1;
-    int w, h, chans; Quantizer quant;
-    unsigned short magic, w16, h16;
-    read_u16(in, &magic); chans = (magic == MAGIC_RGB) ? 3 : 1;
-    read_u16(in, &w16); read_u16(in, &h16); w = w16; h = h16;
-    uchar nl; fread(&nl, 1, 1, in);
-    quant.levels = nl;
-    quant.bounds[0] = 0;
-    for(int i=0; i<nl; i++) { 
-        uchar b; fread(&b, 1, 1, in); quant.bits[i] = b; 
-        if(i>0) quant.bounds[i] = quant.bounds[i-1] + (1 << quant.bits[i-1]);
+    Output out;
+    if (!open_output(&out, output, input)) { close_path(in); return 1; }
+    int result = diftopnm_file_scaled(in, out.fp, scale);
+    close_path(in);
+    return close_output(&out, result);
+}
+
+/**
+ * @brief Decodes a DIF stream into a PNM stream
+ * @param in Input stream positioned at the DIF header
+ * @param out Output stream receiving the PNM image
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_file(FILE *in, FILE *out) {
+    return diftopnm_file_scaled(in, out, 1);
+}
+
+/**
+ * @brief Decodes a DIF stream into a reduced-size PNM stream
+ *
+ * The input is never seeked: single stream payloads are pulled through a
+ * window refilled before each row, segmented payloads are sized by the
+ * segment table. Rows are written out as soon as they are decoded. For a
+ * pyramid file the levels finer than the requested scale are not read;
+ * past the coarsest stored level the closest one is downsampled further.
+ * Banded files are decoded band after band.
+ *
+ * @param in Input stream positioned at the DIF header
+ * @param out Output stream receiving the PNM image
+ * @param scale Reduction factor (1, 2, 4 or 8)
+ * @return 0 on success, 1 on failure
+ */
+int diftopnm_file_scaled(FILE *in, FILE *out, int scale) {
+    int shift = 0;
+    while (shift < MAX_LEVELS && (1 << shift) < scale) shift++;
+    if ((1 << shift) != scale) return 1;
+
+    DifHeader hd;
+    if (!read_header(in, &hd)) return 1;
+    int w = hd.w, h = hd.h, chans = hd.channels, n = hd.streams;
+    int runs = hd.flags & DIF_FLAG_RUNS, color = (hd.flags & DIF_FLAG_COLOR) != 0;
+    Stream s[MAX_STREAMS];
+    RowSink sink = {0};
+    int ok;
+
+    if (hd.flags & DIF_FLAG_PYRAMID) {
+        /* Decode from the coarsest level down to the closest stored one */
+        int target = (shift < hd.levels) ? shift : hd.levels;
+        uchar *lvl[MAX_LEVELS + 1] = {0};
+        ok = sink_init(&sink, out, level_dim(w, target), level_dim(h, target), chans, shift - target, 0);
+        for (int k = hd.levels; k >= target && ok; k--) {
+            int lw = level_dim(w, k), lh = level_dim(h, k);
+            uchar *comp = read_segment(in, &hd, hd.levels - k, s);
+            if (k > target) lvl[k] = malloc((long)lw * lh * chans);
+            if (!comp || (k > target && !lvl[k])) ok = 0;
+            else ok = decode_level(s, n, &hd.quant, runs, (k < hd.levels) ? lvl[k + 1] : NULL, lw, lh, chans,
+                                   lvl[k], (k == target) ? &sink : NULL);
+            free(comp);
+        }
+        for (int k = 0; k <= MAX_LEVELS; k++) free(lvl[k]);
+        sink_free(&sink);
+        header_free(&hd);
+        return (ok && fflush(out) == 0) ? 0 : 1;
     }
-    
-    int total = w * h * chans;
-    uchar first[3]; fread(first, 1, chans, in);
-    
-    long pos = ftell(in); fseek(in, 0, SEEK_END);
-    long csize = ftell(in) - pos; fseek(in, pos, SEEK_SET);
-    uchar *comp = malloc(csize); fread(comp, 1, csize, in);
-    fclose(in);
-
-    Stream s; stream_init_read(&s, comp, csize);
-    uchar *red = malloc(total);
-    int prev[3];
-    for(int c=0; c<chans; c++) { red[c] = first[c]; prev[c] = first[c]; }
-
-    for (int i = 1; i < w * h; i++) {
-        for (int c = 0; c < chans; c++) {
-            uchar enc; decode_value(&s, &enc, &quant);
-            int current = prev[c] + zigzag_decode(enc);
-            prev[c] = current;
-            red[i * chans + c] = current;
+
+    if (hd.flags & DIF_FLAG_RESTART) {
+        ok = sink_init(&sink, out, w, h, chans, shift, color);
+        for (int b = 0; b < hd.segments && ok; b++) {
+            int bh = ((b + 1) * hd.band_rows < h) ? hd.band_rows : h - b * hd.band_rows;
+            uchar *comp = read_segment(in, &hd, b, s);
+            ok = comp && decode_level(s, n, &hd.quant, runs, NULL, w, bh, chans, NULL, &sink);
+            free(comp);
         }
+        sink_free(&sink);
+        header_free(&hd);
+        return (ok && fflush(out) == 0) ? 0 : 1;
     }
+
+    int rowsize = w * chans;
+    /* Bytes a row of residuals can span */
+    int rowbytes = (rowsize * SLOT_BITS + 7) / 8 + 1;
+    long csize = 0;
+    uchar *comp;
+    if (hd.segments > 0) {
+        comp = read_segment(in, &hd, 0, s);
+        if (!comp) { header_free(&hd); return 1; }
+    } else {
+        csize = 2L * rowbytes + 4096;
+        comp = malloc(csize);
+        if (!comp) return 1;
+        stream_init_read(&s[0], comp, 0);
+    }
+
+    uchar *sym = malloc(rowsize);
+    uchar *row = malloc(rowsize);
+    ok = sym && row && sink_init(&sink, out, w, h, chans, shift, color);
+    int prev[3], phase = 0;
+    for(int c=0; c<chans; c++) prev[c] = hd.first[c];
+
+    for (int y = 0; y < h && ok; y++) {
+        int x0 = (y == 0) ? 1 : 0;
+        int count = (w - x0) * chans;
+        if (hd.segments == 0) stream_refill(&s[0], comp, csize, rowbytes, in);
+        if (!decode_interleaved(s, n, phase, sym, count, &hd.quant, runs)) { ok = 0; break; }
+        phase = (phase + count) % n;
+
+        if (y == 0) for (int c = 0; c < chans; c++) row[c] = hd.first[c];
+        for (int x = x0, k = 0; x < w; x++) {
+            for (int c = 0; c < chans; c++, k++) {
+                int current = (prev[c] + zigzag_decode(sym[k])) & 127;
+                prev[c] = current;
+                row[x * chans + c] = current;
+            }
+        }
+        if (!sink_row(&sink, row)) ok = 0;
+    }
+    if (ok && fflush(out) != 0) ok = 0;
     
-    Picture pic = {w, h, chans, malloc(total)};
-    for(int i=0; i<total; i++) pic.pixels[i] = red[i] << 1;
-    picture_save(output, &pic);
-    
-    free(comp); free(red); free(pic.pixels);
-    return 0;
+    sink_free(&sink);
+    free(comp); free(sym); free(row); header_free(&hd);
+    return ok ? 0 : 1;
 }
 
 /* ========================================================================
@@ -447,7 +1603,8 @@ int is_dif_file(const char *path) {
     fclose(fp);
     if (!res) return 0;
     unsigned short magic = bytes[0] | (bytes[1] << 8);
-    return (magic == MAGIC_GRAY || magic == MAGIC_RGB);
+    return (magic == MAGIC_GRAY || magic == MAGIC_RGB ||
+            magic == MAGIC_GRAY_EXT || magic == MAGIC_RGB_EXT);
 }
 
 /**
@@ -508,6 +1665,126 @@ long get_raw_size(const char *pnm) {
     return size;
 }
 
+/**
+ * @brief Hashes the dimensions and pixels of a PNM image
+ * @param path Path to the PNM file
+ * @param hash Receives the 64-bit FNV-1a hash (header comments are ignored)
+ * @return 1 on success, 0 on failure
+ */
+int pnm_hash(const char *path, unsigned long long *hash) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    Picture pic;
+    int ok = picture_read_header(fp, &pic);
+    if (ok) {
+        uchar buf[65536];
+        int dims[3] = {pic.w, pic.h, pic.channels};
+        unsigned long long h = hash_bytes((const uchar *)dims, sizeof(dims), FNV_OFFSET);
+        for (long left = (long)pic.w * pic.h * pic.channels; left > 0 && ok; ) {
+            size_t chunk = (left < (long)sizeof(buf)) ? (size_t)left : sizeof(buf);
+            if (fread(buf, 1, chunk, fp) != chunk) ok = 0;
+            else h = hash_bytes(buf, chunk, h);
+            left -= chunk;
+        }
+        *hash = h;
+    }
+    fclose(fp);
+    return ok;
+}
+
+/**
+ * @brief Hashes the whole content of a file
+ * @param path Path to the file
+ * @param hash Receives the 64-bit FNV-1a hash
+ * @return 1 on success, 0 on failure
+ */
+int file_hash(const char *path, unsigned long long *hash) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    uchar buf[65536];
+    unsigned long long h = FNV_OFFSET;
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) h = hash_bytes(buf, len, h);
+    int ok = !ferror(fp);
+    fclose(fp);
+    if (ok) *hash = h;
+    return ok;
+}
+
+/**
+ * @brief Opens an output path for writing
+ *
+ * An existing regular file (symbolic links followed) is written to a
+ * temporary file beside it, which keeps its mode and replaces it in
+ * close_output() only once complete: a failed conversion leaves it
+ * untouched, and it may be the input itself. New files, FIFOs and devices
+ * are written in place, as is a file whose directory is read-only unless
+ * it is the input.
+ *
+ * @param o Receives the open output
+ * @param path Path to the output file ("-" for stdout)
+ * @param input Path to the input file ("-" for stdin), or NULL
+ * @return 1 on success, 0 on failure
+ */
+int open_output(Output *o, const char *path, const char *input) {
+    struct stat st, in;
+    *o = (Output){0};
+    if (strcmp(path, "-") == 0) {
+        o->fp = stdout;
+        return 1;
+    }
+    if (stat(path, &st) != 0) {
+        o->path = strdup(path);
+        o->fp = o->path ? fopen(path, "wb") : NULL;
+        if (!o->fp) { free(o->path); o->path = NULL; return 0; }
+        o->created = 1;
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        o->fp = fopen(path, "wb");
+        return o->fp != NULL;
+    }
+
+    o->path = realpath(path, NULL);
+    o->tmp = o->path ? malloc(strlen(o->path) + 8) : NULL;
+    if (o->tmp) {
+        sprintf(o->tmp, "%s.XXXXXX", o->path);
+        int fd = mkstemp(o->tmp);
+        if (fd >= 0 && fchmod(fd, st.st_mode & 07777) == 0) o->fp = fdopen(fd, "wb");
+        if (o->fp) return 1;
+        if (fd >= 0) { close(fd); unlink(o->tmp); }
+    }
+    free(o->tmp); free(o->path);
+    o->tmp = o->path = NULL;
+
+    /* No temporary file possible: truncating the input would lose it */
+    int same = input && (strcmp(input, "-") == 0 ? fstat(STDIN_FILENO, &in) : stat(input, &in)) == 0
+               && in.st_dev == st.st_dev && in.st_ino == st.st_ino;
+    if (same) return 0;
+    o->fp = fopen(path, "wb");
+    return o->fp != NULL;
+}
+
+/**
+ * @brief Closes an output opened with open_output
+ *
+ * On success a temporary file replaces the output; on failure it is
+ * removed, as is an output created by open_output.
+ *
+ * @param o Output to close
+ * @param result Result of the conversion (0 on success)
+ * @return 0 on success, 1 on failure
+ */
+int close_output(Output *o, int result) {
+    if (!o->fp) return 1;
+    if ((o->fp == stdout ? fflush(o->fp) : fclose(o->fp)) != 0) result = 1;
+    if (o->tmp && result == 0 && rename(o->tmp, o->path) != 0) result = 1;
+    if (result != 0 && (o->tmp || o->created)) remove(o->tmp ? o->tmp : o->path);
+    free(o->tmp); free(o->path);
+    *o = (Output){0};
+    return result;
+}
+
 /**
  * @brief Converts an image to PNM format using ImageMagick
  * @param input Path to input image file
@@ -540,18 +1817,32 @@ void print_help(const char *prog) {
     printf("Usage: %s <mode> <input> <output> [options]\n\n", prog);
     printf("Modes:\n");
     printf("  -c              Encode mode (PNM to DIF)\n");
-    printf("  -d              Decode mode (DIF to PNM)\n\n");
+    printf("  -d              Decode mode (DIF to PNM)\n");
+    printf("  -u <previous>   Update mode, recode only the bands changed since <previous> (DIF)\n");
+    printf("  -D <socket>     Daemon mode, serve requests on a Unix socket\n\n");
     printf("Arguments:\n");
-    printf("  <input>         Input file path\n");
-    printf("  <output>        Output file path\n\n");
+    printf("  <input>         Input file path (- for stdin, PNM or DIF only)\n");
+    printf("  <output>        Output file path (- for stdout)\n\n");
     printf("Options:\n");
     printf("  -v              Enable verbose output\n");
     printf("  -t              Enable timing measurements\n");
     printf("  -o              Open image with viewer (decode mode only)\n");
+    printf("  -s <n>          Interleave residuals over n bitstreams, n = 4 or 8 (encode mode only)\n");
+    printf("  -z              Code runs of identical pixels as one symbol (encode mode only)\n");
+    printf("  -y              Decorrelate RGB channels with a YCoCg-R transform (encode mode only)\n");
+    printf("  -p              Store 1/2, 1/4 and 1/8 scale levels (encode mode only)\n");
+    printf("  -R <rows>       Code bands of <rows> rows independently for later updates (encode mode only)\n");
+    printf("  -C <dir>        Reuse results cached in <dir> for unchanged images (encode mode only)\n");
+    printf("  -M <MB>         Size cap of the cache, least recently used entries evicted (default 1024)\n");
+    printf("  -r <n>          Decode at 1/n scale, n = 2, 4 or 8 (decode mode only)\n");
+    printf("  -w <n>          Number of worker threads (daemon mode only)\n");
     printf("  -h              Display this help message\n\n");
     printf("Examples:\n");
     printf("  %s -c image.pnm image.dif -v\n", prog);
     printf("  %s -d image.dif image.pnm -t -o\n", prog);
+    printf("  curl -s URL | %s -c - - | upload\n", prog);
+    printf("  %s -u frame.dif frame.pnm frame.dif -v\n", prog);
+    printf("  %s -D /tmp/codec.sock -w 4\n", prog);
 }
 
 /**
@@ -565,6 +1856,6 @@ void verbose_printf(Options *opts, const char *format, ...) {
     
     va_list args;
     va_start(args, format);
-    vprintf(format, args);
+    vfprintf(opts->log ? opts->log : stdout, format, args);
     va_end(args);
 }
\ No newline at end of file
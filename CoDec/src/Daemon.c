@@ -0,0 +1,789 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "CoDec.h"
+
+/** @brief Size of a request or response header in bytes */
+#define HEADER_SIZE 8
+/** @brief Number of log2 latency buckets (in microseconds) */
+#define LATENCY_BUCKETS 32
+/** @brief Most client connections open at once, idle or not */
+#define MAX_CONNECTIONS 256
+/** @brief Deadline for receiving a header, a payload or sending a response */
+#define IO_TIMEOUT_US 10000000ULL
+/** @brief Longest wait between two checks of the shutdown flag, in milliseconds */
+#define POLL_SLICE_MS 200
+/** @brief Largest response the event loop sends itself (STATS text included) */
+#define RESPONSE_MAX (HEADER_SIZE + 1024)
+/** @brief Worker buffers larger than this are released after each request */
+#define WORKER_KEEP_BYTES (16 * 1024 * 1024)
+
+/** @brief Response status: request served */
+#define STATUS_OK        0
+/** @brief Response status: the codec rejected the payload */
+#define STATUS_CODEC     1
+/** @brief Response status: malformed request */
+#define STATUS_BAD       2
+/** @brief Response status: payload larger than DAEMON_MAX_PAYLOAD */
+#define STATUS_TOO_LARGE 3
+/** @brief Response status: all workers and queue slots are taken, retry later */
+#define STATUS_BUSY      4
+
+/**
+ * @brief Client connection and the request header being received on it
+ * @var Conn::fd Client socket
+ * @var Conn::passed Descriptor attached to the header, or -1
+ * @var Conn::hdr Header bytes
+ * @var Conn::got Number of header bytes received so far
+ * @var Conn::skip Payload bytes of a refused request still to be discarded
+ * @var Conn::resp Response queued by the event loop
+ * @var Conn::resp_len Size of the queued response
+ * @var Conn::resp_sent Bytes of the queued response already sent
+ * @var Conn::deadline Time by which the header, the discarded payload or the queued response must be done (us)
+ */
+typedef struct {
+    int fd;
+    int passed;
+    uchar hdr[HEADER_SIZE];
+    int got;
+    size_t skip;
+    uchar resp[RESPONSE_MAX];
+    int resp_len, resp_sent;
+    unsigned long long deadline;
+} Conn;
+
+/**
+ * @brief Bounded queue of requests whose header is complete
+ * @var RequestQueue::items Ring buffer of connections
+ * @var RequestQueue::cap Capacity of the ring buffer
+ * @var RequestQueue::head Index of the oldest request
+ * @var RequestQueue::count Number of queued requests
+ */
+typedef struct {
+    Conn *items;
+    int cap, head, count;
+} RequestQueue;
+
+/**
+ * @brief Queue of served connections given back to the event loop
+ * @var ConnQueue::fds Ring buffer of client descriptors
+ * @var ConnQueue::cap Capacity of the ring buffer
+ * @var ConnQueue::head Index of the oldest descriptor
+ * @var ConnQueue::count Number of queued descriptors
+ */
+typedef struct {
+    int *fds;
+    int cap, head, count;
+} ConnQueue;
+
+/**
+ * @brief Per-worker reusable buffers
+ * @var Worker::in Request payload buffer
+ * @var Worker::in_cap Capacity of the payload buffer
+ * @var Worker::out Response payload buffer
+ * @var Worker::out_cap Capacity of the response buffer
+ */
+typedef struct {
+    uchar *in;
+    size_t in_cap;
+    uchar *out;
+    size_t out_cap;
+} Worker;
+
+/** @brief Set by the signal handler to request shutdown */
+static volatile sig_atomic_t stopping = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static RequestQueue queue;
+static ConnQueue returned;
+/** @brief Write end of the pipe waking the event loop when a connection is returned */
+static int wake_fd = -1;
+
+/* Counters, protected by lock */
+static int worker_count, busy_workers, open_connections;
+static unsigned long served, failed;
+static unsigned long long latency_sum, latency_max;
+static unsigned long latency_hist[LATENCY_BUCKETS];
+
+/**
+ * @brief Signal handler asking the accept loop and the workers to stop
+ * @param sig Signal number (unused)
+ */
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * @brief Returns a monotonic timestamp in microseconds
+ * @return Microseconds since an arbitrary origin
+ */
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Records a served request in the counters
+ * @param us Latency of the request in microseconds
+ * @param ok 1 if the request succeeded, 0 otherwise
+ */
+static void record_latency(unsigned long long us, int ok) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1ULL << bucket) < us) bucket++;
+    pthread_mutex_lock(&lock);
+    served++;
+    if (!ok) failed++;
+    latency_sum += us;
+    if (us > latency_max) latency_max = us;
+    latency_hist[bucket]++;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Gets an upper bound of a latency percentile from the histogram
+ * @param pct Percentile (0-100)
+ * @return Upper bound of the bucket holding the percentile, in microseconds
+ *
+ * Must be called with lock held.
+ */
+static unsigned long long latency_percentile(int pct) {
+    unsigned long target = (served * pct + 99) / 100, seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += latency_hist[b];
+        if (seen >= target && seen > 0) return 1ULL << b;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a 32-bit unsigned integer in little-endian format
+ * @param p Destination (4 bytes)
+ * @param val Value to write
+ */
+static void put_u32(uchar *p, unsigned int val) {
+    p[0] = val & 0xFF; p[1] = (val >> 8) & 0xFF;
+    p[2] = (val >> 16) & 0xFF; p[3] = (val >> 24) & 0xFF;
+}
+
+/**
+ * @brief Reads a 32-bit unsigned integer in little-endian format
+ * @param p Source (4 bytes)
+ * @return Decoded value
+ */
+static unsigned int get_u32(const uchar *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/**
+ * @brief Waits until a descriptor is ready, giving up at a deadline or on shutdown
+ * @param fd Descriptor
+ * @param events POLLIN or POLLOUT
+ * @param deadline Time limit in microseconds (now_us() clock)
+ * @return 1 if ready, 0 on timeout, shutdown or error
+ */
+static int wait_ready(int fd, short events, unsigned long long deadline) {
+    for (;;) {
+        unsigned long long now = now_us();
+        if (stopping || now >= deadline) return 0;
+        unsigned long long left_ms = (deadline - now + 999) / 1000;
+        struct pollfd pfd = { fd, events, 0 };
+        int ready = poll(&pfd, 1, left_ms < POLL_SLICE_MS ? (int)left_ms : POLL_SLICE_MS);
+        if (ready < 0 && errno != EINTR) return 0;
+        if (ready > 0) return 1;
+    }
+}
+
+/**
+ * @brief Sends a whole buffer on a socket before a deadline
+ * @param fd Socket descriptor
+ * @param buf Data to send
+ * @param len Number of bytes
+ * @param deadline Time limit in microseconds
+ * @return 1 on success, 0 on failure or timeout
+ */
+static int send_all(int fd, const uchar *buf, size_t len, unsigned long long deadline) {
+    while (len > 0) {
+        if (!wait_ready(fd, POLLOUT, deadline)) return 0;
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n <= 0) return 0;
+        buf += n; len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Receives exactly len bytes from a socket before a deadline
+ * @param fd Socket descriptor
+ * @param buf Destination buffer
+ * @param len Number of bytes
+ * @param deadline Time limit in microseconds
+ * @return 1 on success, 0 on failure, end of stream or timeout
+ */
+static int recv_all(int fd, uchar *buf, size_t len, unsigned long long deadline) {
+    while (len > 0) {
+        if (!wait_ready(fd, POLLIN, deadline)) return 0;
+        ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n <= 0) return 0;
+        buf += n; len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends a response header without payload
+ * @param fd Socket descriptor
+ * @param status Response status
+ * @return 1 on success, 0 on failure
+ */
+static int send_status(int fd, int status) {
+    uchar resp[HEADER_SIZE];
+    put_u32(resp, status); put_u32(resp + 4, 0);
+    return send_all(fd, resp, HEADER_SIZE, now_us() + IO_TIMEOUT_US);
+}
+
+/**
+ * @brief Receives the available part of a request header without blocking
+ *
+ * A descriptor passed with SCM_RIGHTS is kept in c->passed.
+ *
+ * @param c Pointer to the connection
+ * @return 1 if the header is complete, 0 if more bytes are needed, -1 on end of stream or error
+ */
+static int recv_header_part(Conn *c) {
+    for (;;) {
+        union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } ctrl;
+        struct iovec iov = { c->hdr + c->got, HEADER_SIZE - c->got };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov; msg.msg_iovlen = 1;
+        msg.msg_control = ctrl.buf; msg.msg_controllen = sizeof(ctrl.buf);
+        ssize_t n = recvmsg(c->fd, &msg, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        for (struct cmsghdr *m = CMSG_FIRSTHDR(&msg); m; m = CMSG_NXTHDR(&msg, m)) {
+            if (m->cmsg_level == SOL_SOCKET && m->cmsg_type == SCM_RIGHTS) {
+                if (c->passed >= 0) close(c->passed);
+                memcpy(&c->passed, CMSG_DATA(m), sizeof(int));
+            }
+        }
+        c->got += n;
+        return c->got == HEADER_SIZE;
+    }
+}
+
+/**
+ * @brief Discards the available part of the payload of a refused request
+ * @param c Pointer to the connection
+ * @return 0 on progress, -1 on end of stream or error
+ */
+static int skip_payload(Conn *c) {
+    uchar buf[65536];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, c->skip < sizeof(buf) ? c->skip : sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        c->skip -= n;
+        return 0;
+    }
+}
+
+/**
+ * @brief Closes a client connection and the descriptor attached to it
+ * @param fd Client socket
+ * @param passed Attached descriptor, or -1
+ */
+static void close_connection(int fd, int passed) {
+    if (passed >= 0) close(passed);
+    close(fd);
+    pthread_mutex_lock(&lock);
+    open_connections--;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Grows a worker buffer to hold at least size bytes
+ * @param buf Pointer to the buffer
+ * @param cap Pointer to the buffer capacity
+ * @param size Required size
+ * @return 1 on success, 0 on allocation failure
+ */
+static int reserve(uchar **buf, size_t *cap, size_t size) {
+    if (size <= *cap) return 1;
+    size_t n = *cap ? *cap : 4096;
+    while (n < size) n *= 2;
+    uchar *p = realloc(*buf, n);
+    if (!p) return 0;
+    *buf = p; *cap = n;
+    return 1;
+}
+
+/**
+ * @brief Reads the whole content of a passed descriptor into the input buffer
+ * @param w Pointer to the worker
+ * @param fd Descriptor to read until end of file
+ * @param len Receives the number of bytes read
+ * @param deadline Time limit in microseconds
+ * @return STATUS_OK, STATUS_BAD or STATUS_TOO_LARGE
+ */
+static int read_descriptor(Worker *w, int fd, size_t *len, unsigned long long deadline) {
+    *len = 0;
+    for (;;) {
+        if (!reserve(&w->in, &w->in_cap, *len + 65536)) return STATUS_BAD;
+        if (!wait_ready(fd, POLLIN, deadline)) return STATUS_BAD;
+        ssize_t n = read(fd, w->in + *len, w->in_cap - *len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return STATUS_BAD;
+        if (n == 0) return STATUS_OK;
+        *len += n;
+        if (*len > DAEMON_MAX_PAYLOAD) return STATUS_TOO_LARGE;
+    }
+}
+
+/**
+ * @brief Gets an upper bound of the output size of a codec request
+ *
+ * For decoding the bound comes from the dimensions of the DIF header,
+ * which are not trusted: the caller refuses bounds past DAEMON_MAX_PAYLOAD.
+ *
+ * @param op Request opcode
+ * @param in Request payload
+ * @param len Payload size
+ * @return Output capacity needed, in bytes
+ */
+static size_t output_bound(int op, const uchar *in, size_t len) {
+    if (op == DAEMON_OP_ENCODE) {
+        /* Every residual takes at most 11 bits, pyramid levels add a third */
+        return 2 * len + 64 + 4 * (MAX_LEVELS + 1) * MAX_STREAMS;
+    }
+    if (len < 6) return 64;
+    size_t w = in[2] | (in[3] << 8), h = in[4] | (in[5] << 8);
+    unsigned short magic = in[0] | (in[1] << 8);
+    size_t chans = (magic == MAGIC_RGB || magic == MAGIC_RGB_EXT) ? 3 : 1;
+    return w * h * chans + 64;
+}
+
+/**
+ * @brief Runs an encode or decode request through the in-memory codec
+ * @param w Pointer to the worker (payload in w->in)
+ * @param op Request opcode
+ * @param flags Request flags
+ * @param streams Number of interleaved bitstreams for encoding
+ * @param level Pyramid levels when encoding, reduction factor when decoding
+ * @param len Payload size
+ * @param out_len Receives the result size (result in w->out)
+ * @return STATUS_OK, STATUS_CODEC, STATUS_BAD or STATUS_TOO_LARGE
+ */
+static int run_codec(Worker *w, int op, int flags, int streams, int level, size_t len, size_t *out_len) {
+    if (len == 0) return STATUS_BAD;
+    size_t bound = output_bound(op, w->in, len);
+    if (op == DAEMON_OP_DECODE && bound > DAEMON_MAX_PAYLOAD + 64) return STATUS_TOO_LARGE;
+    if (!reserve(&w->out, &w->out_cap, bound)) return STATUS_BAD;
+    FILE *in = fmemopen(w->in, len, "rb");
+    FILE *out = fmemopen(w->out, w->out_cap, "wb");
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return STATUS_BAD;
+    }
+    int result;
+    if (op == DAEMON_OP_ENCODE) {
+        Params params = { .streams = streams ? streams : 1, .pyramid = level,
+                          .runs = (flags & DAEMON_FLAG_RUNS) != 0, .color = (flags & DAEMON_FLAG_COLOR) != 0 };
+        result = pnmtodif_file(in, out, &params);
+    } else {
+        result = diftopnm_file_scaled(in, out, level ? level : 1);
+    }
+    long pos = ftell(out);
+    fclose(in);
+    fclose(out);
+    if (result != 0 || pos < 0) return STATUS_CODEC;
+    *out_len = pos;
+    return STATUS_OK;
+}
+
+/**
+ * @brief Queues a response header without payload on a connection
+ * @param c Pointer to the connection
+ * @param status Response status
+ */
+static void queue_status(Conn *c, int status) {
+    put_u32(c->resp, status); put_u32(c->resp + 4, 0);
+    c->resp_len = HEADER_SIZE;
+    c->resp_sent = 0;
+}
+
+/**
+ * @brief Queues the answer to a STATS request: health and latency counters as text
+ *
+ * Built by the event loop, so health checks are served even when all
+ * workers are busy.
+ *
+ * @param c Pointer to the connection
+ */
+static void queue_stats(Conn *c) {
+    pthread_mutex_lock(&lock);
+    int n = snprintf((char *)c->resp + HEADER_SIZE, RESPONSE_MAX - HEADER_SIZE,
+                     "status %s\nworkers %d\nbusy %d\nqueued %d\nconnections %d\n"
+                     "requests %lu\nerrors %lu\n"
+                     "latency_avg_us %llu\nlatency_max_us %llu\n"
+                     "latency_p50_us %llu\nlatency_p99_us %llu\n",
+                     stopping ? "stopping" : "ok", worker_count, busy_workers, queue.count, open_connections,
+                     served, failed,
+                     served ? latency_sum / served : 0, latency_max,
+                     latency_percentile(50), latency_percentile(99));
+    pthread_mutex_unlock(&lock);
+    if (n > RESPONSE_MAX - HEADER_SIZE - 1) n = RESPONSE_MAX - HEADER_SIZE - 1;
+    put_u32(c->resp, STATUS_OK); put_u32(c->resp + 4, n);
+    c->resp_len = HEADER_SIZE + n;
+    c->resp_sent = 0;
+}
+
+/**
+ * @brief Sends what the socket accepts of a queued response, without blocking
+ * @param c Pointer to the connection
+ * @return 0 on progress (the rest waits for POLLOUT), -1 on error
+ */
+static int flush_response(Conn *c) {
+    while (c->resp_sent < c->resp_len) {
+        ssize_t n = send(c->fd, c->resp + c->resp_sent, c->resp_len - c->resp_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        c->resp_sent += n;
+    }
+    c->resp_len = c->resp_sent = 0;
+    return 0;
+}
+
+/**
+ * @brief Serves one request whose header has been received
+ * @param w Pointer to the worker
+ * @param c Pointer to the connection holding the header
+ * @return 1 if the connection can take further requests, 0 if it must be closed
+ */
+static int serve_request(Worker *w, Conn *c) {
+    unsigned long long start = now_us();
+    int op = c->hdr[0], flags = c->hdr[1], streams = c->hdr[2], level = c->hdr[3];
+    size_t len = get_u32(c->hdr + 4), out_len = 0;
+    int status = STATUS_OK;
+
+    if (flags & DAEMON_FLAG_FD) {
+        if (c->passed < 0) status = STATUS_BAD;
+        else status = read_descriptor(w, c->passed, &len, start + IO_TIMEOUT_US);
+    } else if (len > DAEMON_MAX_PAYLOAD) {
+        /* The payload cannot be skipped safely, drop the connection */
+        send_status(c->fd, STATUS_TOO_LARGE);
+        record_latency(now_us() - start, 0);
+        return 0;
+    } else if (len > 0) {
+        if (!reserve(&w->in, &w->in_cap, len) || !recv_all(c->fd, w->in, len, start + IO_TIMEOUT_US)) return 0;
+    }
+    if (c->passed >= 0) { close(c->passed); c->passed = -1; }
+
+    if (status == STATUS_OK) {
+        if (op == DAEMON_OP_ENCODE || op == DAEMON_OP_DECODE) status = run_codec(w, op, flags, streams, level, len, &out_len);
+        else status = STATUS_BAD;
+    }
+    if (status != STATUS_OK) out_len = 0;
+
+    uchar resp[HEADER_SIZE];
+    unsigned long long deadline = now_us() + IO_TIMEOUT_US;
+    put_u32(resp, status); put_u32(resp + 4, out_len);
+    int sent = send_all(c->fd, resp, HEADER_SIZE, deadline) && send_all(c->fd, w->out, out_len, deadline);
+    record_latency(now_us() - start, status == STATUS_OK);
+    return sent;
+}
+
+/**
+ * @brief Worker thread: takes requests from the queue and serves them
+ *
+ * A connection is held only for one request, then given back to the
+ * event loop to wait for the next one.
+ *
+ * @param arg Pointer to the Worker structure
+ * @return NULL
+ */
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (queue.count == 0 && !stopping) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += POLL_SLICE_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+            pthread_cond_timedwait(&not_empty, &lock, &ts);
+        }
+        if (stopping) { pthread_mutex_unlock(&lock); break; }
+        Conn c = queue.items[queue.head];
+        queue.head = (queue.head + 1) % queue.cap;
+        queue.count--;
+        busy_workers++;
+        pthread_mutex_unlock(&lock);
+
+        int keep = serve_request(w, &c);
+        /* Do not pin the memory of an occasional large request */
+        if (w->in_cap > WORKER_KEEP_BYTES) { free(w->in); w->in = NULL; w->in_cap = 0; }
+        if (w->out_cap > WORKER_KEEP_BYTES) { free(w->out); w->out = NULL; w->out_cap = 0; }
+
+        pthread_mutex_lock(&lock);
+        busy_workers--;
+        if (keep) {
+            returned.fds[(returned.head + returned.count) % returned.cap] = c.fd;
+            returned.count++;
+        }
+        pthread_mutex_unlock(&lock);
+        if (keep) {
+            /* A full pipe already wakes the event loop */
+            uchar b = 1;
+            ssize_t n = write(wake_fd, &b, 1);
+            (void)n;
+        }
+        else close_connection(c.fd, c.passed);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Handles a connection whose request header is complete
+ *
+ * STATS is answered by the event loop; codec requests are queued for the
+ * pool, or refused with STATUS_BUSY when the queue is full. The payload of
+ * a refused request is then discarded by the event loop so that the client
+ * reads the status and can retry on the same connection. Responses are
+ * only queued here: the event loop never waits for a client to read.
+ *
+ * @param c Pointer to the connection (reset for the next header if kept)
+ * @return 1 if the event loop keeps watching the connection, 0 if it was handed over or closed
+ */
+static int dispatch(Conn *c) {
+    int op = c->hdr[0], flags = c->hdr[1];
+    size_t len = get_u32(c->hdr + 4);
+    c->got = 0;
+    c->deadline = 0;
+    if (op == DAEMON_OP_STATS && !(flags & DAEMON_FLAG_FD)) {
+        queue_stats(c);
+        if (flush_response(c) == 0) return 1;
+        close_connection(c->fd, c->passed);
+        return 0;
+    }
+    pthread_mutex_lock(&lock);
+    int full = (queue.count == queue.cap);
+    if (!full) {
+        queue.items[(queue.head + queue.count) % queue.cap] = *c;
+        queue.count++;
+        pthread_cond_signal(&not_empty);
+    }
+    pthread_mutex_unlock(&lock);
+    if (!full) return 0;
+
+    record_latency(0, 0);
+    if (c->passed >= 0) { close(c->passed); c->passed = -1; }
+    queue_status(c, STATUS_BUSY);
+    if (flush_response(c) != 0 || (!(flags & DAEMON_FLAG_FD) && len > DAEMON_MAX_PAYLOAD)) {
+        close_connection(c->fd, c->passed);
+        return 0;
+    }
+    if (!(flags & DAEMON_FLAG_FD)) c->skip = len;
+    return 1;
+}
+
+/**
+ * @brief Event loop: accepts connections and receives request headers
+ *
+ * Idle connections and partial headers only cost a slot of the poll set.
+ * No new header is read from a connection while its queued response is
+ * pending (a refused payload is still discarded), and a header, discarded
+ * payload or response not done within IO_TIMEOUT_US closes the connection.
+ *
+ * @param listener Listening socket
+ * @param wake Read end of the wake pipe
+ */
+static void event_loop(int listener, int wake) {
+    Conn *conns = malloc(MAX_CONNECTIONS * sizeof(Conn));
+    struct pollfd *pfds = malloc((MAX_CONNECTIONS + 2) * sizeof(struct pollfd));
+    int count = 0;
+    if (!conns || !pfds) { free(conns); free(pfds); return; }
+
+    while (!stopping) {
+        pfds[0] = (struct pollfd){ listener, POLLIN, 0 };
+        pfds[1] = (struct pollfd){ wake, POLLIN, 0 };
+        for (int i = 0; i < count; i++) {
+            int pending = conns[i].resp_sent < conns[i].resp_len;
+            short events = pending ? POLLOUT : POLLIN;
+            if (pending && conns[i].skip > 0) events |= POLLIN;
+            pfds[i + 2] = (struct pollfd){ conns[i].fd, events, 0 };
+        }
+        int ready = poll(pfds, count + 2, POLL_SLICE_MS);
+        if (ready < 0 && errno != EINTR) break;
+        unsigned long long now = now_us();
+
+        /* Backwards, so that moving the last connection into a freed slot is safe */
+        for (int i = count - 1; i >= 0; i--) {
+            Conn *c = &conns[i];
+            int keep = 1;
+            short rev = pfds[i + 2].revents;
+            if (rev) {
+                int r = 0;
+                if (c->resp_sent < c->resp_len && (rev & ~POLLIN)) r = flush_response(c);
+                if (r == 0 && (rev & ~POLLOUT)) {
+                    if (c->skip > 0) r = skip_payload(c);
+                    else if (c->resp_sent == c->resp_len) r = recv_header_part(c);
+                }
+                if (r < 0) { close_connection(c->fd, c->passed); keep = 0; }
+                else if (r > 0) keep = dispatch(c);
+            }
+            if (keep && c->got == 0 && c->skip == 0 && c->resp_sent == c->resp_len) c->deadline = 0;
+            else if (keep && c->deadline == 0) c->deadline = now + IO_TIMEOUT_US;
+            else if (keep && now > c->deadline) { close_connection(c->fd, c->passed); keep = 0; }
+            if (!keep) conns[i] = conns[--count];
+        }
+
+        if (pfds[1].revents) { uchar b[64]; while (read(wake, b, sizeof(b)) > 0) { } }
+        pthread_mutex_lock(&lock);
+        while (returned.count > 0) {
+            conns[count++] = (Conn){ .fd = returned.fds[returned.head], .passed = -1 };
+            returned.head = (returned.head + 1) % returned.cap;
+            returned.count--;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (pfds[0].revents) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0) continue;
+            pthread_mutex_lock(&lock);
+            int full = (open_connections >= MAX_CONNECTIONS);
+            if (!full) open_connections++;
+            pthread_mutex_unlock(&lock);
+            if (full) {
+                /* A new socket has room for the status; never wait for it */
+                Conn refused = { .fd = fd, .passed = -1 };
+                queue_status(&refused, STATUS_BUSY);
+                flush_response(&refused);
+                close(fd);
+            }
+            else conns[count++] = (Conn){ .fd = fd, .passed = -1 };
+        }
+    }
+    for (int i = 0; i < count; i++) close_connection(conns[i].fd, conns[i].passed);
+    free(conns); free(pfds);
+}
+
+/**
+ * @brief Removes a stale listening socket, leaving any other kind of file alone
+ * @param path Filesystem path of the socket
+ * @return 1 if the path is now free, 0 if it holds something else
+ */
+static int remove_socket(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) return 0;
+    return unlink(path) == 0;
+}
+
+/**
+ * @brief Runs the codec daemon on a Unix domain socket until SIGINT/SIGTERM
+ * @param socket_path Filesystem path of the listening socket
+ * @param workers Number of worker threads (0 for one per online CPU)
+ * @param opts Pointer to Options structure (verbose logging)
+ * @return 0 on clean shutdown, 1 on failure
+ */
+int serve_daemon(const char *socket_path, int workers, Options *opts) {
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0) workers = 1;
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return 1;
+    strcpy(addr.sun_path, socket_path);
+
+    if (!remove_socket(socket_path)) return 1;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) return 1;
+    /* Requests beyond the queue bound are refused with STATUS_BUSY */
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 4 * workers) != 0) {
+        close(listener);
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    stopping = 0;
+    open_connections = 0;
+    queue.cap = 2 * workers;
+    queue.head = queue.count = 0;
+    queue.items = malloc(queue.cap * sizeof(Conn));
+    returned.cap = MAX_CONNECTIONS;
+    returned.head = returned.count = 0;
+    returned.fds = malloc(returned.cap * sizeof(int));
+    Worker *pool = calloc(workers, sizeof(Worker));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    int wake[2] = {-1, -1};
+    if (!queue.items || !returned.fds || !pool || !threads || pipe(wake) != 0) {
+        free(queue.items); free(returned.fds); free(pool); free(threads);
+        close(listener); remove_socket(socket_path);
+        return 1;
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    wake_fd = wake[1];
+    worker_count = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, &pool[i]) != 0) break;
+        worker_count++;
+    }
+    verbose_printf(opts, "Listening on %s with %d workers\n", socket_path, worker_count);
+
+    if (worker_count > 0) event_loop(listener, wake[0]);
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&not_empty);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < worker_count; i++) pthread_join(threads[i], NULL);
+
+    while (queue.count > 0) {
+        Conn *c = &queue.items[queue.head];
+        close_connection(c->fd, c->passed);
+        queue.head = (queue.head + 1) % queue.cap;
+        queue.count--;
+    }
+    while (returned.count > 0) {
+        close_connection(returned.fds[returned.head], -1);
+        returned.head = (returned.head + 1) % returned.cap;
+        returned.count--;
+    }
+    for (int i = 0; i < workers; i++) { free(pool[i].in); free(pool[i].out); }
+    free(pool); free(threads); free(queue.items); free(returned.fds);
+    close(wake[0]); close(wake[1]);
+    wake_fd = -1;
+    close(listener);
+    remove_socket(socket_path);
+    verbose_printf(opts, "Daemon stopped after %lu requests\n", served);
+    return worker_count > 0 ? 0 : 1;
+}
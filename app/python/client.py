@@ -0,0 +1,80 @@
+import os
+import socket
+import struct
+import sys
+
+
+socket_path = "/tmp/codec.sock"
+
+OP_ENCODE = 1
+OP_DECODE = 2
+OP_STATS = 3
+FLAG_FD = 0x01
+
+
+def request(sock, op, payload=b"", fd=None, streams=1, level=0):
+    """Sends one request to the daemon and returns (status, result bytes).
+
+    level is the number of pyramid levels when encoding and the reduction
+    factor when decoding (0 for the defaults).
+    """
+    if fd is None:
+        header = struct.pack("<BBBBI", op, 0, streams, level, len(payload))
+        sock.sendall(header + payload)
+    else:
+        header = struct.pack("<BBBBI", op, FLAG_FD, streams, level, 0)
+        socket.send_fds(sock, [header], [fd])
+
+    status, length = struct.unpack("<II", recv_exact(sock, 8))
+    return status, recv_exact(sock, length)
+
+
+def recv_exact(sock, length):
+    data = bytearray()
+    while len(data) < length:
+        chunk = sock.recv(min(length - len(data), 1 << 20))
+        if not chunk:
+            raise ConnectionError("daemon closed the connection")
+        data += chunk
+    return bytes(data)
+
+
+def run_client():
+    if len(sys.argv) < 2 or sys.argv[1] not in ("encode", "decode", "stats"):
+        print(f"Usage: {sys.argv[0]} encode|decode <input> <output> [--fd]")
+        print(f"       {sys.argv[0]} stats")
+        return 1
+
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(socket_path)
+
+        if sys.argv[1] == "stats":
+            status, result = request(sock, OP_STATS)
+            print(result.decode(), end="")
+            return status
+
+        op = OP_ENCODE if sys.argv[1] == "encode" else OP_DECODE
+        input_path, output_path = sys.argv[2], sys.argv[3]
+
+        if "--fd" in sys.argv:
+            fd = os.open(input_path, os.O_RDONLY)
+            try:
+                status, result = request(sock, op, fd=fd)
+            finally:
+                os.close(fd)
+        else:
+            with open(input_path, "rb") as f:
+                status, result = request(sock, op, f.read())
+
+    if status != 0:
+        print(f"Request failed with status {status}")
+        return 1
+
+    with open(output_path, "wb") as f:
+        f.write(result)
+    print(f"{input_path} -> {output_path} ({len(result)} bytes)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(run_client())
@@ -5,6 +5,8 @@ import subprocess
 input_folder = "../IMAGES_TESTS"
 output_folder = "ENCODED_RESULTS" 
 codec_path = "./main"
+# Encoded results are reused from here for unchanged images (None to disable)
+cache_folder = ".dif_cache"
 
 def run_codec():
     # Check if the input folder exists
@@ -33,6 +35,8 @@ def run_codec():
         base_name = os.path.splitext(filename)[0]
         output_path = os.path.join(output_folder, base_name + ".encoded")
         command = [codec_path, "-c", input_path, output_path]
+        if cache_folder:
+            command += ["-C", cache_folder]
         
         try:
             print(f"Encoding: {filename} -> {output_path}")
@@ -11,19 +11,38 @@ int main(int argc, char **argv) {
         return (argc < 2);
     }
 
-    if (argc < 4) {
+    int min_args = (strcmp(argv[1], "-D") == 0) ? 3 : (strcmp(argv[1], "-u") == 0) ? 5 : 4;
+    if (argc < min_args) {
         fprintf(stderr, "Error: Missing arguments\n");
         print_help(argv[0]);
         return 1;
     }
 
     Options opts = {0};
+    Params params = { .streams = 1 };
+    int workers = 0, scale = 1;
+    const char *cache_dir = NULL;
+    long cache_max = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-v") == 0) opts.verbose = 1;
         else if (strcmp(argv[i], "-t") == 0) opts.timing = 1;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) params.streams = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0) params.pyramid = MAX_LEVELS;
+        else if (strcmp(argv[i], "-z") == 0) params.runs = 1;
+        else if (strcmp(argv[i], "-y") == 0) params.color = 1;
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) params.band_rows = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) scale = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) cache_dir = argv[++i];
+        else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) cache_max = atol(argv[++i]) * 1024 * 1024;
     }
 
+    /* Keep stdout clean for the image data when writing to a pipe */
+    opts.log = stdout;
+    const char *dest = (strcmp(argv[1], "-u") == 0) ? argv[4] : argv[3];
+    if (strcmp(argv[1], "-D") != 0 && strcmp(dest, "-") == 0) opts.log = stderr;
+
     if (opts.timing) opts.start_time = clock();
 
     int result = 0;
@@ -35,7 +54,10 @@ int main(int argc, char **argv) {
         const char *output = argv[3];
         char *pnm_tmp = NULL;
 
-        if (!is_pnm_file(input)) {
+        int from_stdin = (strcmp(input, "-") == 0);
+
+        /* The cache converts other formats itself, and only on a miss */
+        if (!from_stdin && !cache_dir && !is_pnm_file(input)) {
             verbose_printf(&opts, "Input is not PNM, converting...\n");
 
             pnm_tmp = change_extension(input, ".pnm");
@@ -51,16 +73,27 @@ int main(int argc, char **argv) {
         }
 
         if (opts.verbose) {
-            long size_in = file_size(argv[2]);
-            printf("Input file: %s (%ld bytes)\n", argv[2], size_in);
-            printf("Output file: %s\n", output);
+            if (from_stdin) fprintf(opts.log, "Input file: stdin\n");
+            else fprintf(opts.log, "Input file: %s (%ld bytes)\n", argv[2], file_size(argv[2]));
+            fprintf(opts.log, "Output file: %s\n", output);
         }
 
-        result = pnmtodif(input, output);
+        if (params.streams > 1) verbose_printf(&opts, "Interleaving over %d bitstreams\n", params.streams);
+        if (params.runs) verbose_printf(&opts, "Coding runs of identical pixels\n");
+        if (params.color) verbose_printf(&opts, "Decorrelating colors with YCoCg-R\n");
+        if (params.pyramid > 0) verbose_printf(&opts, "Storing %d pyramid levels\n", params.pyramid);
+        if (params.band_rows > 0) verbose_printf(&opts, "Coding bands of %d rows\n", params.band_rows);
+
+        if (cache_dir) {
+            int hit = 0;
+            result = pnmtodif_cached(input, output, &params, cache_dir, cache_max, &hit);
+            if (result == 0) verbose_printf(&opts, "Cache %s in %s\n", hit ? "hit" : "miss", cache_dir);
+        }
+        else result = pnmtodif_params(input, output, &params);
 
         if (result == 0 && opts.verbose) {
-            long size_out = file_size(output);
-            printf("Encoding successful. Final size: %ld bytes\n", size_out);
+            if (strcmp(output, "-") == 0) fprintf(opts.log, "Encoding successful.\n");
+            else fprintf(opts.log, "Encoding successful. Final size: %ld bytes\n", file_size(output));
         }
 
         if (pnm_tmp) {
@@ -79,15 +112,41 @@ int main(int argc, char **argv) {
         verbose_printf(&opts, "Input file: %s\n", argv[2]);
         verbose_printf(&opts, "Output file: %s\n", argv[3]);
 
-        result = diftopnm(argv[2], argv[3]);
+        if (scale > 1) verbose_printf(&opts, "Reduction factor: 1/%d\n", scale);
+
+        result = diftopnm_scaled(argv[2], argv[3], scale);
 
         if (result == 0) {
             verbose_printf(&opts, "Decoding successful.\n");
-            if (open_image) {
+            if (open_image && strcmp(argv[3], "-") != 0) {
                 display_file(argv[3], "xdg-open");
             }
         }
     }
+    else if (strcmp(argv[1], "-u") == 0) {
+        verbose_printf(&opts, "=== UPDATE MODE ===\n");
+
+        const char *output = argv[4];
+        int recoded = 0;
+
+        verbose_printf(&opts, "Previous file: %s\n", argv[2]);
+        verbose_printf(&opts, "Input file: %s\n", argv[3]);
+        verbose_printf(&opts, "Output file: %s\n", output);
+
+        result = difupdate(argv[2], argv[3], output, &recoded);
+
+        if (result == 0 && opts.verbose) {
+            fprintf(opts.log, "Update successful. Bands recoded: %d\n", recoded);
+            if (strcmp(output, "-") != 0) fprintf(opts.log, "Final size: %ld bytes\n", file_size(output));
+        }
+    }
+    else if (strcmp(argv[1], "-D") == 0) {
+        verbose_printf(&opts, "=== DAEMON MODE ===\n");
+
+        result = serve_daemon(argv[2], workers, &opts);
+
+        if (result != 0) fprintf(stderr, "Error: Cannot serve on %s\n", argv[2]);
+    }
     else {
         fprintf(stderr, "Error: Unknown mode %s\n", argv[1]);
         print_help(argv[0]);
@@ -97,8 +156,8 @@ int main(int argc, char **argv) {
     if (opts.timing) {
         clock_t end = clock();
         double elapsed = (double)(end - opts.start_time) / CLOCKS_PER_SEC;
-        printf("\n=== EXECUTION TIME ===\n");
-        printf("Execution time: %.3f seconds\n", elapsed);
+        fprintf(opts.log, "\n=== EXECUTION TIME ===\n");
+        fprintf(opts.log, "Execution time: %.3f seconds\n", elapsed);
     }
 
     return result;